@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "cache.hpp"
+#include "function.hpp"
+#include "memory.hpp"
+#include "options.hpp"
+#include "targets.hpp"
+
+// A different build of the converter may generate different code, so keys
+// include a hash of the converter itself.
+static std::string converterHash() {
+    auto exe = llvm::sys::fs::getMainExecutable(nullptr, reinterpret_cast<void *>(&converterHash));
+    auto buffer = llvm::MemoryBuffer::getFile(exe);
+    if (!buffer) {
+        fprintf(stderr, "Failed to read %s: %s\n", exe.c_str(), buffer.getError().message().c_str());
+        exit(EXIT_FAILURE);
+    }
+    llvm::SHA1 hash;
+    hash.update((*buffer)->getBuffer());
+    return llvm::toHex(hash.final(), true);
+}
+
+// Add the struct types in a type, including those nested in it.
+static void collectStructs(llvm::Type *type, std::set<llvm::StructType *>& structs) {
+    if (auto s = llvm::dyn_cast<llvm::StructType>(type)) {
+        if (!structs.insert(s).second)
+            return;
+    }
+    for (auto element : type->subtypes()) {
+        collectStructs(element, structs);
+    }
+}
+
+// Write the body and size of each struct type. The function only shows
+// their names, but their layout decides offsets and sizes in its code.
+static void writeStructs(llvm::raw_ostream& out, const std::set<llvm::StructType *>& structs, const llvm::DataLayout& layout) {
+    std::vector<std::string> lines;
+    for (const auto s : structs) {
+        std::string line;
+        llvm::raw_string_ostream lineOut(line);
+        lineOut << "struct ";
+        s->print(lineOut);
+        lineOut << " {";
+        for (auto element : s->elements()) {
+            lineOut << " ";
+            element->print(lineOut);
+        }
+        lineOut << " }";
+        if (s->isSized()) {
+            lineOut << " " << layout.getTypeAllocSize(s).getFixedValue();
+        }
+        lineOut.flush();
+        lines.push_back(line);
+    }
+    // Sort them, as the set is ordered by address.
+    std::sort(lines.begin(), lines.end());
+    for (const auto& line : lines) {
+        out << line << "\n";
+    }
+}
+
+FunctionCache::FunctionCache(const char *dir, const GlobalMemory& memory, const Options& options, const CallTargets& targets)
+    : dir(dir)
+    , memory(memory)
+    , options(options)
+    , targets(targets)
+    , salt(converterHash()) {
+    std::error_code ec;
+    std::filesystem::create_directories(this->dir, ec);
+    if (ec) {
+        fprintf(stderr, "Failed to create %s: %s\n", dir, ec.message().c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+std::string FunctionCache::path(const std::string& key) const {
+    return dir + "/" + key;
+}
+
+std::string FunctionCache::key(const llvm::Function& func) const {
+    std::string text;
+    llvm::raw_string_ostream out(text);
+
+    out << "converter " << salt << "\n";
+    out << "model " << static_cast<int>(options.memoryModel) << "\n";
+    out << "inline " << options.inlineLimit << "\n";
+    out << "layout " << func.getParent()->getDataLayoutStr() << "\n";
+    func.print(out);
+
+    // The code also depends on where the globals and functions it uses ended
+    // up, which can change without the function changing.
+    std::set<const llvm::Constant *> visited;
+    std::vector<const llvm::Constant *> work;
+    std::set<llvm::StructType *> structs;
+    for (const auto& block : func) {
+        for (const auto& ins : block) {
+            collectStructs(ins.getType(), structs);
+            if (auto gep = llvm::dyn_cast<llvm::GetElementPtrInst>(&ins)) {
+                collectStructs(gep->getSourceElementType(), structs);
+            } else if (auto alloca = llvm::dyn_cast<llvm::AllocaInst>(&ins)) {
+                collectStructs(alloca->getAllocatedType(), structs);
+            }
+            for (const auto& op : ins.operands()) {
+                collectStructs(op->getType(), structs);
+                if (auto c = llvm::dyn_cast<llvm::Constant>(op)) {
+                    work.push_back(c);
+                }
+            }
+
+            if (auto call = llvm::dyn_cast<llvm::CallInst>(&ins)) {
+                if (auto guesses = targets.get(call)) {
+                    out << "guess";
+                    for (const auto f : *guesses) {
+                        out << " " << f->getName() << " " << memory.getFuncIndex(f);
+                    }
+                    out << "\n";
+                }
+            }
+        }
+    }
+
+    while (!work.empty()) {
+        auto c = work.back();
+        work.pop_back();
+        if (!visited.insert(c).second)
+            continue;
+
+        if (auto gep = llvm::dyn_cast<llvm::GEPOperator>(c)) {
+            collectStructs(gep->getSourceElementType(), structs);
+        }
+        if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(c)) {
+            auto name = global->getName().str();
+            if (auto field = memory.getField(name)) {
+                out << "field " << name << " " << *field << "\n";
+            } else if (auto table = memory.getTable(name)) {
+                out << "table " << name << " " << table->field << "\n";
+            } else {
+                out << "global " << name << " " << memory.getAddress(name) << "\n";
+            }
+        } else if (auto f = llvm::dyn_cast<llvm::Function>(c)) {
+            if (f->hasAddressTaken()) {
+                out << "function " << f->getName() << " " << memory.getFuncIndex(f) << "\n";
+            }
+        } else if (!llvm::isa<llvm::GlobalValue>(c)) {
+            for (const auto& op : c->operands()) {
+                work.push_back(llvm::cast<llvm::Constant>(op));
+            }
+        }
+    }
+
+    writeStructs(out, structs, func.getParent()->getDataLayout());
+
+    out.flush();
+    llvm::SHA1 hash;
+    hash.update(text);
+    return llvm::toHex(hash.final(), true);
+}
+
+bool FunctionCache::load(const std::string& key, Function& out) {
+    std::ifstream file(path(key));
+    if (file.fail() || !out.load(file)) {
+        misses++;
+        return false;
+    }
+
+    used.insert(key);
+    hits++;
+    return true;
+}
+
+void FunctionCache::store(const std::string& key, const Function& function) {
+    // Write to a temporary first so an interrupted run leaves no broken entry.
+    auto fileName = path(key);
+    auto tempName = fileName + ".tmp";
+    std::ofstream file(tempName);
+    if (file.fail()) {
+        fprintf(stderr, "Failed to open %s\n", tempName.c_str());
+        exit(EXIT_FAILURE);
+    }
+    function.save(file);
+    file.close();
+
+    std::error_code ec;
+    std::filesystem::rename(tempName, fileName, ec);
+    if (ec) {
+        fprintf(stderr, "Failed to write %s: %s\n", fileName.c_str(), ec.message().c_str());
+        exit(EXIT_FAILURE);
+    }
+    used.insert(key);
+}
+
+void FunctionCache::prune() {
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        if (entry.is_regular_file() && used.count(entry.path().filename().string()) == 0) {
+            std::filesystem::remove(entry.path(), ec);
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef CONVERTER_CACHE_H
+#define CONVERTER_CACHE_H
+
+#include <cstdint>
+#include <set>
+#include <string>
+
+namespace llvm {
+    class Function;
+}
+
+class CallTargets;
+class Function;
+class GlobalMemory;
+struct Options;
+
+// Keeps the code generated for each function on disk, so that functions that
+// did not change since the last run do not have to be compiled again.
+class FunctionCache {
+    std::string dir;
+    const GlobalMemory& memory;
+    const Options& options;
+    const CallTargets& targets;
+    // Hash of the converter's executable.
+    std::string salt;
+
+    // Keys used by this run. Anything else in the cache is stale.
+    std::set<std::string> used;
+
+    std::string path(const std::string& key) const;
+
+public:
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+
+    FunctionCache(const char *dir, const GlobalMemory& memory, const Options& options, const CallTargets& targets);
+
+    // Hash everything the generated code for the function depends on.
+    std::string key(const llvm::Function& func) const;
+
+    // Load a cached function, returning false if there is none.
+    bool load(const std::string& key, Function& out);
+
+    void store(const std::string& key, const Function& function);
+
+    // Remove entries not used by this run.
+    void prune();
+};
+
+#endif
@@ -1,8 +1,13 @@
 #include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <fstream>
+#include <memory>
+#include <set>
+#include <thread>
 
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/InstrTypes.h>
@@ -11,25 +16,183 @@
 #include <llvm/IR/Value.h>
 #include <llvm/IR/Verifier.h>
 
+#include "cache.hpp"
 #include "compiler.hpp"
 #include "function.hpp"
+#include "legalize.hpp"
+#include "optimize.hpp"
+#include "targets.hpp"
 
-Compiler::Compiler(llvm::Module *m, const char *outDir) : m(m), outDir(outDir) {}
+Compiler::Compiler(llvm::Module *m, const char *outDir, const Options& options) : m(m), outDir(outDir), options(options) {}
 
 void Compiler::compile() {
+    removeDeadCode();
+    optimize();
     compileData();
     compileCode();
+
+    if (!options.snapshotFiles.empty()) {
+        snapshot.take(*m, globalMemory, options.snapshotFiles);
+    }
+}
+
+// Functions the runtime calls into. Everything else is only kept if one of
+// these can reach it.
+static const char *ROOT_FUNCTIONS[] = {
+    "D_DoomMain",
+    "D_DoomInit",
+    "D_DoomStart",
+    "D_RunFrame",
+    "D_PostEvent",
+    "M_vsnprintf",
+};
+
+// Functions that processBuiltins lowers memory intrinsics to, which nothing
+// calls by name until then.
+static const char *BUILTIN_FUNCTIONS[] = {
+    "memset",
+    "memcpy",
+    "memmove",
+};
+
+void Compiler::removeDeadCode() {
+    std::vector<const llvm::GlobalValue *> work;
+    for (const auto name : ROOT_FUNCTIONS) {
+        auto func = m->getFunction(name);
+        if (func != nullptr && !func->isDeclaration()) {
+            work.push_back(func);
+        }
+    }
+    // Without any of the runtime's entry points, there is no telling what is
+    // used, so keep everything.
+    if (work.empty())
+        return;
+    for (const auto name : BUILTIN_FUNCTIONS) {
+        auto func = m->getFunction(name);
+        if (func != nullptr && !func->isDeclaration()) {
+            work.push_back(func);
+        }
+    }
+
+    // Anything a reachable function or initializer refers to is reachable,
+    // which includes functions whose address is stored in reachable data.
+    std::set<const llvm::GlobalValue *> reachable;
+    std::vector<const llvm::Constant *> constants;
+    auto visit = [&](const llvm::Value *v) {
+        if (auto c = llvm::dyn_cast<llvm::Constant>(v)) {
+            constants.push_back(c);
+        }
+    };
+    std::set<const llvm::Constant *> visited;
+    while (!work.empty()) {
+        auto value = work.back();
+        work.pop_back();
+        if (!reachable.insert(value).second)
+            continue;
+
+        if (auto func = llvm::dyn_cast<llvm::Function>(value)) {
+            for (const auto& block : *func) {
+                for (const auto& ins : block) {
+                    for (const auto& op : ins.operands()) {
+                        visit(op);
+                    }
+                }
+            }
+        } else if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(value)) {
+            if (global->hasInitializer()) {
+                visit(global->getInitializer());
+            }
+        }
+
+        while (!constants.empty()) {
+            auto c = constants.back();
+            constants.pop_back();
+            if (!visited.insert(c).second)
+                continue;
+
+            if (auto global = llvm::dyn_cast<llvm::GlobalValue>(c)) {
+                work.push_back(global);
+            } else {
+                for (const auto& op : c->operands()) {
+                    visit(op);
+                }
+            }
+        }
+    }
+
+    const auto& layout = m->getDataLayout();
+    std::vector<llvm::GlobalValue *> dead;
+    for (auto& func : *m) {
+        if (!func.isDeclaration() && reachable.count(&func) == 0) {
+            removed.push_back({ func.getName().str(), true, func.getInstructionCount() });
+            dead.push_back(&func);
+        }
+    }
+    for (auto& global : m->globals()) {
+        if (global.hasInitializer() && reachable.count(&global) == 0) {
+            auto size = layout.getTypeAllocSize(global.getValueType()).getFixedValue();
+            removed.push_back({ global.getName().str(), false, uint32_t(size) });
+            dead.push_back(&global);
+        }
+    }
+
+    // Dead code and data may refer to each other, so let go of every
+    // reference before deleting any of them.
+    for (const auto value : dead) {
+        value->dropAllReferences();
+    }
+    for (const auto value : dead) {
+        value->replaceAllUsesWith(llvm::UndefValue::get(value->getType()));
+        value->eraseFromParent();
+    }
+
+    uint32_t functionCount = 0, globalCount = 0, instructions = 0, bytes = 0;
+    for (const auto& entry : removed) {
+        if (entry.isFunction) {
+            functionCount++;
+            instructions += entry.size;
+        } else {
+            globalCount++;
+            bytes += entry.size;
+        }
+    }
+    printf("Removed %u unused functions with %u instructions and %u unused globals with %u bytes\n",
+        functionCount, instructions, globalCount, bytes);
+}
+
+void Compiler::optimize() {
+    // As with dead code, only a program with entry points can be treated as
+    // a whole.
+    std::set<std::string> entryPoints;
+    for (const auto name : ROOT_FUNCTIONS) {
+        auto func = m->getFunction(name);
+        if (func != nullptr && !func->isDeclaration()) {
+            entryPoints.insert(name);
+        }
+    }
+    if (!entryPoints.empty()) {
+        entryPoints.insert(std::begin(BUILTIN_FUNCTIONS), std::end(BUILTIN_FUNCTIONS));
+    }
+    optimizeModule(*m, options.optLevel, entryPoints);
 }
 
 void Compiler::compileData() {
     const auto& layout = m->getDataLayout();
 
     // Make sure all functions that have their address taken have an index.
+    // Each signature gets a contiguous range, keeping its dispatcher dense.
+    std::vector<const llvm::Function *> addressTaken;
     for (const auto& func : *m) {
         if (func.hasAddressTaken()) {
-            globalMemory.registerFunction(&func);
+            addressTaken.push_back(&func);
         }
     }
+    std::stable_sort(addressTaken.begin(), addressTaken.end(), [](const llvm::Function *a, const llvm::Function *b) {
+        return FuncPtrType(a->getFunctionType()) < FuncPtrType(b->getFunctionType());
+    });
+    for (const auto func : addressTaken) {
+        globalMemory.registerFunction(func);
+    }
 
     auto& e = llvm::errs();
     if (llvm::verifyModule(*m, &e)) {
@@ -46,15 +209,34 @@ void Compiler::compileData() {
         return layout.getTypeStoreSize(a->getValueType()) < layout.getTypeStoreSize(b->getValueType());
     });
 
-    // First, find where globals will live in memory.
+    // Scalars whose address is never taken, and constant arrays that are only
+    // indexed, can live outside of memory.
+    auto promotedCount = 0U, tableCount = 0U;
+    std::vector<const llvm::GlobalVariable *> memoryGlobals;
     for (const auto& global : sortedGlobals) {
+        if (globalMemory.promoteGlobal(*global, layout)) {
+            promotedCount++;
+        } else if (globalMemory.tabulateGlobal(*global, layout)) {
+            tableCount++;
+        } else {
+            memoryGlobals.push_back(global);
+        }
+    }
+    printf("Promoted %u globals to fields\n", promotedCount);
+    printf("Moved %u constant tables to arrays\n", tableCount);
+
+    // First, find where globals will live in memory.
+    for (const auto& global : memoryGlobals) {
         globalMemory.registerGlobal(*global, layout);
     }
 
     // Next, initialize the data.
     globalMemory.align();
     globalMemory.allocateMemory();
-    for (const auto& global : sortedGlobals) {
+    globalMemory.reserve(options.zoneSize, options.stackSize);
+    printf("Memory is %u bytes, with %u of globals, %u of zone and %u of stack\n",
+        globalMemory.memorySize(), globalMemory.end(), options.zoneSize, options.stackSize);
+    for (const auto& global : memoryGlobals) {
         globalMemory.initializeGlobal(*global, layout);
     }
 }
@@ -63,8 +245,8 @@ void Compiler::compileCode() {
     const auto& layout = m->getDataLayout();
 
     for (auto& func : *m) {
-        // Remove any 64-bit loads/stores from this function.
-        remove64Bit(func);
+        // Split 64-bit operations into 32-bit halves.
+        legalize64Bit(func);
         // Process any LLVM builtins.
         processBuiltins(func);
         // Make sure we didn't break it.
@@ -75,77 +257,90 @@ void Compiler::compileCode() {
         }
     }
 
-    for (auto& func : *m) {
-        // Skip any functions not defined.
-        if (func.isDeclaration())
-            continue;
+    // Guess where function pointers go, to call them directly.
+    CallTargets targets(layout);
+    targets.analyze(*m);
 
-        auto& f = functions.emplace_back();
-        f.compile(func, layout, globalMemory);
+    // Skip any functions not defined.
+    std::vector<const llvm::Function *> defined;
+    for (const auto& func : *m) {
+        if (!func.isDeclaration()) {
+            defined.push_back(&func);
+        }
     }
-}
-
-void Compiler::remove64Bit(llvm::Function& f) {
-    auto& ctx = m->getContext();
-    const auto& layout = m->getDataLayout();
-
-    auto intType = llvm::IntegerType::get(ctx, 32);
-    auto ptrType = llvm::PointerType::getUnqual(intType);
-
-    std::array<llvm::Value *, 1> indices = { llvm::ConstantInt::get(intType, 1) };
 
-    for (auto& block : f) {
-        for (auto nextIns = &*block.begin(); nextIns != nullptr; ) {
-            auto ins = nextIns;
-            nextIns = ins->getNextNode();
-
-            auto t = ins->getType();
-
-            // Check if size is 64-bit.
-            if (!t->isSized())
-                continue;
-            auto size = layout.getTypeSizeInBits(t).getFixedValue();
-            if (size <= 32)
-                continue;
-            if (size != 64) {
-                fprintf(stderr, "Strange integer size of %lu bits\n", size);
-                exit(EXIT_FAILURE);
-            }
-
-            // We can only fix it if it's a load instruction.
-            if (ins->getOpcode() != llvm::Instruction::Load) {
-                fprintf(stderr, "64-bit non-load instruction\n");
-                exit(EXIT_FAILURE);
-            }
-
-            auto srcPtrLo = ins->getOperand(0);
-            auto srcPtrHi = llvm::GetElementPtrInst::Create(ptrType, srcPtrLo, indices);
-            srcPtrHi->insertBefore(ins);
-
-            auto loadLo = new llvm::LoadInst(intType, srcPtrLo, llvm::Twine(), ins);
-            auto loadHi = new llvm::LoadInst(intType, srcPtrHi, llvm::Twine(), ins);
-
-            auto users = ins->users();
-            for (auto userIter = users.begin(); userIter != users.end(); ) {
-                auto user = *userIter++;
-                auto userIns = llvm::cast<llvm::Instruction>(user);
+    functions.resize(defined.size());
+
+    // Reuse the code of functions that did not change since the last run.
+    std::unique_ptr<FunctionCache> cache;
+    std::vector<std::string> keys(defined.size());
+    std::vector<bool> cached(defined.size());
+    if (options.cacheDir != nullptr) {
+        cache = std::make_unique<FunctionCache>(options.cacheDir, globalMemory, options, targets);
+        for (auto i = 0U; i < defined.size(); i++) {
+            keys[i] = cache->key(*defined[i]);
+            cached[i] = cache->load(keys[i], functions[i]);
+        }
+    }
 
-                auto dstPtrLo = user->getOperand(1);
-                auto dstPtrHi = llvm::GetElementPtrInst::Create(ptrType, dstPtrLo, indices);
-                dstPtrHi->insertBefore(userIns);
+    // Functions only read the module from here on, so they can be compiled
+    // on several threads. Results keep the module's order.
+    std::vector<size_t> order;
+    std::vector<unsigned> sizes(defined.size());
+    for (auto i = 0U; i < defined.size(); i++) {
+        if (!cached[i]) {
+            order.push_back(i);
+        }
+        sizes[i] = defined[i]->getInstructionCount();
+    }
+    // Start with the largest so that no thread is left with one at the end.
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return sizes[a] > sizes[b];
+    });
 
-                auto storeLo = new llvm::StoreInst(loadLo, dstPtrLo, userIns);
-                auto storeHi = new llvm::StoreInst(loadHi, dstPtrHi, userIns);
+    std::atomic<size_t> next = 0;
+    auto work = [&]() {
+        // DataLayout lays out struct types lazily into a cache with no lock,
+        // so each thread needs its own copy. Copies start with no cache.
+        llvm::DataLayout threadLayout = layout;
+        for (;;) {
+            auto i = next++;
+            if (i >= order.size())
+                break;
+            functions[order[i]].compile(*defined[order[i]], threadLayout, globalMemory, options, targets);
+        }
+    };
 
-                if (userIns == nextIns) {
-                    nextIns = nextIns->getNextNode();
-                }
-                userIns->eraseFromParent();
-            }
+    std::vector<std::thread> threads;
+    for (auto i = 1U; i < options.jobs; i++) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+        thread.join();
+    }
 
-            ins->eraseFromParent();
+    if (cache) {
+        for (const auto i : order) {
+            cache->store(keys[i], functions[i]);
         }
+        cache->prune();
+        printf("Cache: %u hits, %u misses\n", cache->hits, cache->misses);
     }
+
+    size_t structured = 0, values = 0, locals = 0, inlined = 0, guarded = 0;
+    for (const auto& f : functions) {
+        const auto& stats = f.statistics();
+        if (stats.structured) structured++;
+        values += stats.values;
+        locals += stats.locals;
+        inlined += stats.inlined;
+        guarded += stats.guarded;
+    }
+    printf("Structured %zu of %zu functions\n", structured, functions.size());
+    printf("Allocated %zu values to %zu locals\n", values, locals);
+    printf("Inlined %zu memory accesses\n", inlined);
+    printf("Guarded %zu indirect calls with likely targets\n", guarded);
 }
 
 void Compiler::processBuiltins(llvm::Function& f) {
@@ -162,8 +357,9 @@ void Compiler::processBuiltins(llvm::Function& f) {
                 if (auto calledFunc = callIns->getCalledFunction()) {
                     auto name = calledFunc->getName();
 
-                    if (name.starts_with("llvm.lifetime")) {
-                        // Remove lifetime intrinsics.
+                    if (name.starts_with("llvm.lifetime") || name.starts_with("llvm.experimental.noalias.scope.decl")
+                        || name.starts_with("llvm.assume")) {
+                        // Remove hints that do not change what the code does.
                         ins->eraseFromParent();
                     } else if (name.starts_with("llvm.memset") || name.starts_with("llvm.memcpy") || name.starts_with("llvm.memmove")) {
                         llvm::Function *replacement;
@@ -240,10 +436,12 @@ void Compiler::write() {
         exit(EXIT_FAILURE);
     }
 
-    globalMemory.saveMemory(dataFile);
+    globalMemory.saveMemory(dataFile, options.imageFormat);
     dataFile.flush();
     dataFile.close();
 
+    snapshot.save(outDir + std::string("/snapshot.bin"), options.imageFormat);
+
     dataFileName = outDir + std::string("/code.zs");
     dataFile.open(dataFileName);
     if (dataFile.fail()) {
@@ -257,9 +455,61 @@ void Compiler::write() {
         dataFile << function.contents();
     }
 
-    globalMemory.writeFunctionMaps(dataFile);
+    globalMemory.writeDispatchers(dataFile);
+    globalMemory.writeFields(dataFile, m->getDataLayout());
+    globalMemory.writeTables(dataFile);
+    snapshot.writeResume(dataFile);
 
     dataFile << "}\n";
     dataFile.flush();
     dataFile.close();
+
+    // Pick the runtime matching how the code accesses memory.
+    dataFileName = outDir + std::string("/memory.zs");
+    dataFile.open(dataFileName);
+    if (dataFile.fail()) {
+        fprintf(stderr, "Failed to open %s\n", dataFileName.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    globalMemory.writeLayout(dataFile);
+    switch (options.memoryModel) {
+        case MemoryModel::Bytes:
+            dataFile << "#include \"DoomInDoom/memory/bytes.zs\"\n";
+            break;
+        case MemoryModel::Words:
+            dataFile << "#include \"DoomInDoom/memory/words.zs\"\n";
+            break;
+    }
+    dataFile.flush();
+    dataFile.close();
+}
+
+void Compiler::writeReport(const char *fileName) {
+    std::ofstream reportFile;
+    reportFile.open(fileName);
+    if (reportFile.fail()) {
+        fprintf(stderr, "Failed to open %s\n", fileName);
+        exit(EXIT_FAILURE);
+    }
+
+    for (const auto& function : functions) {
+        const auto& stats = function.statistics();
+        reportFile << function.name();
+        reportFile << " " << (stats.structured ? "structured" : "dispatch");
+        reportFile << " values=" << stats.values;
+        reportFile << " locals=" << stats.locals;
+        reportFile << " inlined=" << stats.inlined;
+        reportFile << " guarded=" << stats.guarded;
+        reportFile << "\n";
+    }
+
+    for (const auto& entry : removed) {
+        reportFile << entry.name << " removed";
+        reportFile << (entry.isFunction ? " instructions=" : " bytes=") << entry.size;
+        reportFile << "\n";
+    }
+
+    reportFile.flush();
+    reportFile.close();
 }
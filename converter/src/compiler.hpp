@@ -1,35 +1,55 @@
 #ifndef CONVERTER_COMPILER_H
 #define CONVERTER_COMPILER_H
 
+#include <cstdint>
+#include <string>
 #include <vector>
 
 #include "function.hpp"
 #include "memory.hpp"
+#include "options.hpp"
+#include "snapshot.hpp"
 
 namespace llvm {
     class Function;
     class Module;
 }
 
+// A function or global dropped because nothing the runtime calls reaches it.
+struct RemovedGlobal {
+    std::string name;
+    bool isFunction;
+    // Instructions of a function, or bytes of a global.
+    uint32_t size;
+};
+
 class Compiler {
     llvm::Module *m;
     const char *outDir;
+    const Options& options;
 
 public:
-    Compiler(llvm::Module *m, const char *outDir);
+    Compiler(llvm::Module *m, const char *outDir, const Options& options);
 
     void compile();
     void write();
+    // Write per-function statistics about the generated code.
+    void writeReport(const char *fileName);
 
 private:
+    // Delete functions and globals the runtime can never reach.
+    void removeDeadCode();
+    // Run LLVM passes at the requested level.
+    void optimize();
     void compileData();
     void compileCode();
 
-    void remove64Bit(llvm::Function& f);
     void processBuiltins(llvm::Function& f);
 
     GlobalMemory globalMemory;
     std::vector<Function> functions;
+    std::vector<RemovedGlobal> removed;
+    Snapshot snapshot;
 };
 
 #endif
@@ -1,60 +1,179 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <sstream>
 #include <set>
 
+#include <llvm/Analysis/ValueTracking.h>
 #include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/DataLayout.h>
 #include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/Support/KnownBits.h>
 
 #include "function.hpp"
 #include "memory.hpp"
+#include "options.hpp"
+#include "structure.hpp"
+#include "targets.hpp"
+
+// Where control goes after a statement finishes.
+struct Target {
+    enum Kind {
+        // Nowhere, the statement must not finish.
+        None,
+        // The next statement.
+        Fallthrough,
+        // The start of a merge block.
+        Merge,
+        // The start of another iteration of a loop.
+        Back,
+    } kind;
+    const llvm::BasicBlock *block = nullptr;
+
+    bool operator==(const Target& other) const {
+        return kind == other.kind && block == other.block;
+    }
+};
+
+// A construct in the generated code that can be left with break.
+struct Construct {
+    enum Kind {
+        Loop,
+        Block,
+        Switch,
+        // A region without a construct of its own.
+        Scope,
+    } kind;
+    const llvm::BasicBlock *block;
+    // Where a break out of this construct goes.
+    Target landing;
+    // Jumps that were started inside this construct and have to continue
+    // once it is left.
+    std::vector<Target> pending;
+};
+
+// How to perform a jump from the current position.
+struct JumpAction {
+    enum Kind {
+        Nothing,
+        Break,
+        Continue,
+        // Set the label and break out of the given construct.
+        Escape,
+    } kind;
+    size_t construct = 0;
+};
+
+// How a memory access is written out instead of calling a helper.
+enum class InlineAccess {
+    // Call the helper.
+    None,
+    // A whole word of word-addressed memory.
+    Word,
+    // Part of a word of word-addressed memory.
+    WordPart,
+    // The individual bytes of byte-addressed memory.
+    Bytes,
+};
 
 struct FuncCompileCtx {
     const llvm::DataLayout& layout;
     const GlobalMemory& memory;
+    const Options& options;
+    const CallTargets& targets;
 
-    FuncCompileCtx(const llvm::DataLayout& layout, const GlobalMemory& memory);
+    FuncCompileCtx(const llvm::DataLayout& layout, const GlobalMemory& memory, const Options& options, const CallTargets& targets);
 
     std::ostringstream content;
 
     std::map<const llvm::BasicBlock *, uint32_t> blocks;
     std::map<const llvm::Instruction *, std::string> instructions;
+    // Values evaluated inside the expression using them.
+    std::set<const llvm::Instruction *> folded;
 
-    uint32_t globalCounter = 0U;
-    uint32_t localCounter = 0U;
-    uint32_t phiCounter = 0U;
+    uint32_t numValues = 0U;
+    uint32_t numLocals = 0U;
+
+    // Whether memory helpers are written out in this function.
+    bool inlineMemory = false;
+    uint32_t numInlined = 0U;
+    uint32_t numGuarded = 0U;
     bool usesStack = false;
+    uint32_t varArgsSize = 0U;
+
+    bool structured = false;
+    std::vector<Construct> constructs;
+    std::set<const llvm::BasicBlock *> blockConstructs;
+    bool needsRetry = false;
+    bool usesLabel = false;
 
     std::set<std::string> varNames;
 
     std::string getValue(const llvm::Value *val);
+    std::string getArgument(const llvm::Value *val);
+    const std::string *getField(const llvm::Value *ptr) const;
+    const ConstantTable *getTable(const llvm::Value *ptr) const;
     std::string getSignedValue(const llvm::Value *val);
 
+    bool isNonNegative(const llvm::Value *val) const;
+    bool fitsIn(const llvm::Value *val, unsigned int bits) const;
+    bool actsUnsigned(const llvm::Instruction& ins) const;
+    bool usesSigned(const llvm::Instruction& user, const llvm::Value *value) const;
+
     void compile(const llvm::Function& func);
 
     void compileHeader(const llvm::Function& func);
 
-    void allocRegisters(const llvm::BasicBlock& block);
+    bool canFold(const llvm::Instruction& ins);
+    void findFoldable(const llvm::Function& func);
+    const llvm::Instruction *registerValue(const llvm::Value *value) const;
+    void addUses(const llvm::Instruction& ins, std::set<const llvm::Instruction *>& live) const;
+    void allocRegisters(const llvm::Function& func);
 
     void compileBlock(const llvm::BasicBlock& block);
     void compileIns(const llvm::Instruction& ins);
 
     void compileTerminator(const llvm::Instruction& ins);
+    void compileReturn(const llvm::ReturnInst& ins);
+
+    void compileDispatcher(const llvm::Function& func);
+    bool compileStructured(const llvm::Function& func);
+
+    std::string compileStmt(const Stmt& stmt, Target next);
+    void compileStmtInto(const Stmt& stmt, Target next);
+    void compileEdge(const llvm::BasicBlock *from, const llvm::BasicBlock *to);
+    void compileBranch(const llvm::BasicBlock *from, const llvm::BasicBlock *to);
+    JumpAction resolveJump(Target target, Target next);
+    void compileJump(Target target, Target next);
+    void compileConstructExit(Construct& construct, Target next);
     void compileValue(const llvm::Instruction& ins);
 
+    bool constantAddress(const llvm::Value *ptr, uint32_t& out);
+    bool isAligned(const llvm::Value *ptr, llvm::Align align, uint32_t bytes);
+    InlineAccess inlineAccess(const llvm::Instruction& ins);
+    bool repeatsOperand(const llvm::Instruction& user, const llvm::Value *value);
+    std::string wordIndex(const llvm::Value *ptr);
+    std::string wordShift(const llvm::Value *ptr, uint64_t bitWidth);
+    std::string byteAddress(const llvm::Value *ptr, uint32_t offset);
+    void compileLoad(const llvm::LoadInst& ins);
+    void compileStore(const llvm::StoreInst& ins);
+    void compileAlloca(const llvm::AllocaInst& ins);
+    void compileArguments(const llvm::CallInst& ins, bool first);
+    void compileVarArgs(const llvm::CallInst& ins);
+    void compileGuardedCall(const llvm::CallInst& ins, const std::vector<const llvm::Function *>& guesses);
+
     void truncateValue(llvm::Type *t);
 };
 
-FuncCompileCtx::FuncCompileCtx(const llvm::DataLayout& layout, const GlobalMemory& memory)
+FuncCompileCtx::FuncCompileCtx(const llvm::DataLayout& layout, const GlobalMemory& memory, const Options& options, const CallTargets& targets)
     : layout(layout)
-    , memory(memory) {}
-
-static std::string globalName(unsigned int index) {
-    return "g" + std::to_string(index);
-}
+    , memory(memory)
+    , options(options)
+    , targets(targets) {}
 
 static std::string localName(unsigned int index) {
     return "l" + std::to_string(index);
@@ -66,36 +185,76 @@ static std::string signExtend(const std::string& value, unsigned int bits) {
     return "(int(" + value + "<<" + v + ")>>" + v + ")";
 }
 
+// Whether an expression can be used as an operand without parentheses.
+static bool isAtom(const std::string& expr) {
+    auto name = expr.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.");
+    if (name == std::string::npos)
+        return true;
+    if (expr[name] != '(')
+        return false;
+
+    // Make sure the parenthesis closes at the very end.
+    auto level = 0;
+    for (auto i = name; i < expr.size(); i++) {
+        if (expr[i] == '(') {
+            level++;
+        } else if (expr[i] == ')' && --level == 0) {
+            return i + 1 == expr.size();
+        }
+    }
+    return false;
+}
+
+// Remove parentheses around a whole expression, for places that already
+// delimit it.
+static std::string unwrap(const std::string& expr) {
+    if (expr.empty() || expr[0] != '(')
+        return expr;
+
+    auto level = 0;
+    for (auto i = 0U; i < expr.size(); i++) {
+        if (expr[i] == '(') {
+            level++;
+        } else if (expr[i] == ')' && --level == 0) {
+            if (i + 1 != expr.size())
+                return expr;
+        }
+    }
+    return expr.substr(1, expr.size() - 2);
+}
+
 std::string FuncCompileCtx::getValue(const llvm::Value *val) {
     if (auto v = llvm::dyn_cast<llvm::ConstantInt>(val)) {
         return std::to_string(v->getZExtValue()) + "U";
     } else if (auto v = llvm::dyn_cast<llvm::Instruction>(val)) {
         return instructions.at(v);
     } else if (auto v = llvm::dyn_cast<llvm::ConstantExpr>(val)) {
-        auto baseIns = v->getAsInstruction();
-        std::string result;
-        if (auto ins = llvm::dyn_cast<llvm::GetElementPtrInst>(baseIns)) {
+        // Functions are compiled in parallel, so the expression is read as
+        // it is instead of being turned into an instruction.
+        if (auto gep = llvm::dyn_cast<llvm::GEPOperator>(v)) {
             llvm::APInt elementOffset(32, 0);
-            if (!ins->accumulateConstantOffset(layout, elementOffset)) {
+            if (!gep->accumulateConstantOffset(layout, elementOffset)) {
                 fprintf(stderr, "Non-constant offset\n");
                 exit(EXIT_FAILURE);
             }
 
-            auto ptrName = ins->getOperand(0)->getName().str();
+            auto ptrName = gep->getPointerOperand()->getName().str();
+            if (auto table = memory.getTable(ptrName)) {
+                return std::to_string(elementOffset.getZExtValue() / table->elementBytes) + "U";
+            }
             auto ptrOffset = memory.getAddress(ptrName);
 
-            result = std::to_string(ptrOffset + elementOffset.getZExtValue()) + "U";
-        } else if (auto ins = llvm::dyn_cast<llvm::PtrToIntInst>(baseIns)) {
-            result = std::move(getValue(ins->getOperand(0)));
-        } else if (auto ins = llvm::dyn_cast<llvm::IntToPtrInst>(baseIns)) {
-            result = std::move(getValue(ins->getOperand(0)));
+            return std::to_string(ptrOffset + elementOffset.getZExtValue()) + "U";
+        } else if (v->getOpcode() == llvm::Instruction::PtrToInt || v->getOpcode() == llvm::Instruction::IntToPtr) {
+            return getValue(v->getOperand(0));
         } else {
             fprintf(stderr, "Unsupported constant expression\n");
             exit(EXIT_FAILURE);
         }
-        baseIns->deleteValue();
-        return result;
     } else if (auto v = llvm::dyn_cast<llvm::GlobalVariable>(val)) {
+        if (memory.getTable(v->getName().str())) {
+            return "0U";
+        }
         return std::to_string(memory.getAddress(v->getName().str())) + "U";
     } else if (auto v = llvm::dyn_cast<llvm::ConstantPointerNull>(val)) {
         return "0U";
@@ -116,99 +275,382 @@ std::string FuncCompileCtx::getValue(const llvm::Value *val) {
     }
 }
 
+const std::string *FuncCompileCtx::getField(const llvm::Value *ptr) const {
+    if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(ptr)) {
+        return memory.getField(global->getName().str());
+    }
+    return nullptr;
+}
+
+const ConstantTable *FuncCompileCtx::getTable(const llvm::Value *ptr) const {
+    while (auto gep = llvm::dyn_cast<llvm::GEPOperator>(ptr)) {
+        ptr = gep->getPointerOperand();
+    }
+    if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(ptr)) {
+        return memory.getTable(global->getName().str());
+    }
+    return nullptr;
+}
+
+std::string FuncCompileCtx::getArgument(const llvm::Value *val) {
+    return unwrap(getValue(val));
+}
+
 std::string FuncCompileCtx::getSignedValue(const llvm::Value *val) {
     if (auto v = llvm::dyn_cast<llvm::ConstantInt>(val)) {
         return std::to_string(v->getSExtValue());
     } else {
-        auto base = getValue(val);
         auto bits = layout.getTypeSizeInBits(val->getType()).getFixedValue();
-        if (bits < 32) {
-            return signExtend(base, bits);
-        } else if (bits > 32) {
+        if (bits > 32) {
             fprintf(stderr, "Sign-extending value that is too large\n");
             exit(EXIT_FAILURE);
+        } else if (bits == 32 || isNonNegative(val)) {
+            return "int(" + getValue(val) + ")";
         } else {
-            return "int(" + base + ")";
+            return signExtend(getValue(val), bits);
         }
     }
 }
 
-void FuncCompileCtx::allocRegisters(const llvm::BasicBlock& block) {
-    std::map<const llvm::Instruction *, unsigned int> localMapping;
-    std::set<const llvm::User *> localsAfter;
+// Whether the sign bit of a value is known to be clear.
+bool FuncCompileCtx::isNonNegative(const llvm::Value *val) const {
+    return llvm::computeKnownBits(val, layout).isNonNegative();
+}
+
+// Whether every bit of a value from the given one up is known to be clear.
+bool FuncCompileCtx::fitsIn(const llvm::Value *val, unsigned int bits) const {
+    auto known = llvm::computeKnownBits(val, layout);
+    return known.countMinLeadingZeros() >= known.getBitWidth() - bits;
+}
+
+// Whether a signed operation reads only non-negative values, so it gives
+// the same result as its unsigned form and is compiled as that instead.
+bool FuncCompileCtx::actsUnsigned(const llvm::Instruction& ins) const {
+    switch (ins.getOpcode()) {
+        case llvm::Instruction::SDiv:
+        case llvm::Instruction::SRem:
+            return isNonNegative(ins.getOperand(0)) && isNonNegative(ins.getOperand(1));
+
+        case llvm::Instruction::AShr:
+        case llvm::Instruction::SExt:
+            return isNonNegative(ins.getOperand(0));
 
-    for (const auto& ins : block) {
-        localsAfter.insert(&ins);
+        case llvm::Instruction::ICmp:
+            return llvm::cast<llvm::ICmpInst>(ins).isSigned()
+                && isNonNegative(ins.getOperand(0)) && isNonNegative(ins.getOperand(1));
+
+        default:
+            return false;
     }
+}
 
-    auto nextIndex = 0U;
-    auto localPhiCount = 0U;
+// Deepest nesting of folded values in a single expression, to keep
+// expressions within what the ZScript compiler handles comfortably.
+static constexpr uint32_t MAX_FOLD_DEPTH = 8;
+
+// Whether the user reads the value through a signed conversion. The cast
+// changes how a folded unsigned operation is compiled, so those are kept
+// in variables.
+bool FuncCompileCtx::usesSigned(const llvm::Instruction& user, const llvm::Value *value) const {
+    if (actsUnsigned(user))
+        return false;
+
+    switch (user.getOpcode()) {
+        case llvm::Instruction::SDiv:
+        case llvm::Instruction::SRem:
+        case llvm::Instruction::SExt:
+            return true;
+
+        case llvm::Instruction::AShr:
+            return user.getOperand(0) == value;
+
+        case llvm::Instruction::ICmp:
+            return llvm::cast<llvm::ICmpInst>(user).isSigned();
+
+        case llvm::Instruction::Call: {
+            auto f = llvm::cast<llvm::CallInst>(user).getCalledFunction();
+            // Intrinsics may repeat their operands.
+            return f != nullptr && f->getName().starts_with("llvm.");
+        }
 
-    for (const auto& ins : block) {
-        // Any instructions referenced only in their own block get a "local"
-        // variable, otherwise get a "global" variable.
-        bool isUsedOutsideOfBlock = false;
-        for (const auto user : ins.users()) {
-            if (auto userIns = llvm::dyn_cast<llvm::Instruction>(user)) {
-                if (llvm::isa<llvm::PHINode>(userIns) || userIns->getParent() != &block) {
-                    isUsedOutsideOfBlock = true;
-                    break;
+        default:
+            return false;
+    }
+}
+
+// Whether the instruction can be evaluated as part of its user's expression
+// instead of being stored in a variable. Only side-effect-free values that
+// produce a uint are folded, so the expression keeps its meaning.
+bool FuncCompileCtx::canFold(const llvm::Instruction& ins) {
+    if (!ins.hasOneUse())
+        return false;
+
+    auto user = llvm::dyn_cast<llvm::Instruction>(*ins.user_begin());
+    if (user == nullptr || user->getParent() != ins.getParent() || llvm::isa<llvm::PHINode>(user))
+        return false;
+
+    if (usesSigned(*user, &ins) || repeatsOperand(*user, &ins))
+        return false;
+
+    switch (ins.getOpcode()) {
+        case llvm::Instruction::Load:
+            // Bytes read straight from memory are not a uint.
+            if (inlineAccess(ins) == InlineAccess::Bytes)
+                return false;
+            return !llvm::cast<llvm::LoadInst>(ins).isVolatile();
+
+        case llvm::Instruction::Add:
+        case llvm::Instruction::Sub:
+        case llvm::Instruction::Mul:
+        case llvm::Instruction::UDiv:
+        case llvm::Instruction::URem:
+        case llvm::Instruction::LShr:
+        case llvm::Instruction::Shl:
+        case llvm::Instruction::And:
+        case llvm::Instruction::Or:
+        case llvm::Instruction::Xor:
+        case llvm::Instruction::GetElementPtr:
+        case llvm::Instruction::Trunc:
+        case llvm::Instruction::ZExt:
+        case llvm::Instruction::PtrToInt:
+        case llvm::Instruction::IntToPtr:
+        case llvm::Instruction::Freeze:
+        case llvm::Instruction::Select:
+            return true;
+
+        case llvm::Instruction::ICmp: {
+            // Comparisons produce a bool, which only conditions take as is.
+            if (llvm::isa<llvm::BranchInst>(user))
+                return true;
+            auto select = llvm::dyn_cast<llvm::SelectInst>(user);
+            return select != nullptr && select->getCondition() == &ins;
+        }
+
+        default:
+            return false;
+    }
+}
+
+void FuncCompileCtx::findFoldable(const llvm::Function& func) {
+    for (const auto& block : func) {
+        std::vector<const llvm::Instruction *> order;
+        std::map<const llvm::Instruction *, size_t> position;
+        // The number of instructions that may write memory before each position.
+        std::vector<uint32_t> writesBefore = { 0 };
+        for (const auto& ins : block) {
+            position[&ins] = order.size();
+            order.push_back(&ins);
+            auto writes = ins.mayWriteToMemory() || llvm::isa<llvm::CallInst>(ins);
+            writesBefore.push_back(writesBefore.back() + writes);
+        }
+
+        // A folded value is evaluated where the outermost expression it is
+        // part of is. Loads may not move past anything writing memory.
+        std::map<const llvm::Instruction *, const llvm::Instruction *> evaluatedAt;
+        for (auto it = order.rbegin(); it != order.rend(); it++) {
+            auto ins = *it;
+            if (!canFold(*ins))
+                continue;
+
+            auto user = llvm::cast<llvm::Instruction>(*ins->user_begin());
+            auto at = folded.count(user) ? evaluatedAt.at(user) : user;
+            if (ins->mayReadFromMemory() && writesBefore[position.at(at)] != writesBefore[position.at(ins) + 1])
+                continue;
+
+            folded.insert(ins);
+            evaluatedAt[ins] = at;
+        }
+
+        // Values nested too deeply are kept in variables. This only moves
+        // evaluation earlier, so the ordering above still holds.
+        std::map<const llvm::Instruction *, uint32_t> depth;
+        for (const auto ins : order) {
+            if (!folded.count(ins))
+                continue;
+
+            auto d = 1U;
+            for (const auto& op : ins->operands()) {
+                auto opIns = llvm::dyn_cast<llvm::Instruction>(op);
+                if (opIns != nullptr && folded.count(opIns)) {
+                    d = std::max(d, depth.at(opIns) + 1);
                 }
             }
-        }
 
-        if (llvm::isa<llvm::PHINode>(ins)) {
-            localPhiCount++;
+            if (d > MAX_FOLD_DEPTH) {
+                folded.erase(ins);
+            } else {
+                depth[ins] = d;
+            }
         }
+    }
+}
 
-        std::string varName;
+const llvm::Instruction *FuncCompileCtx::registerValue(const llvm::Value *value) const {
+    auto ins = llvm::dyn_cast<llvm::Instruction>(value);
+    if (ins == nullptr || ins->use_empty() || folded.count(ins))
+        return nullptr;
+    return ins;
+}
 
-        if (isUsedOutsideOfBlock) {
-            instructions[&ins] = globalName(globalCounter++);
-            varNames.insert(instructions.at(&ins));
-        } else if (ins.users().begin() != ins.users().end()) {
-            // To save on locals, check if any locals we've already allocated
-            // have no more uses in this block.
-            unsigned int reusable;
-            bool canBeReused = false;
-            for (const auto [prevIns, prevIndex] : localMapping) {
-                for (const auto user : prevIns->users()) {
-                    if (localsAfter.find(user) != localsAfter.end()) {
-                        goto alreadyUsed;
-                    }
+void FuncCompileCtx::addUses(const llvm::Instruction& ins, std::set<const llvm::Instruction *>& live) const {
+    // Folded operands are evaluated here, so what they use is used here.
+    for (const auto& op : ins.operands()) {
+        auto opIns = llvm::dyn_cast<llvm::Instruction>(op);
+        if (opIns != nullptr && folded.count(opIns)) {
+            addUses(*opIns, live);
+        } else if (auto v = registerValue(op)) {
+            live.insert(v);
+        }
+    }
+}
+
+void FuncCompileCtx::allocRegisters(const llvm::Function& func) {
+    using ValueSet = std::set<const llvm::Instruction *>;
+
+    // Phis are written on the edges into their block, and their incoming
+    // values are read at the end of the predecessors, so neither counts
+    // towards what is live at the start of the block.
+    std::map<const llvm::BasicBlock *, ValueSet> liveIn;
+
+    auto computeLiveOut = [&](const llvm::BasicBlock& block) {
+        ValueSet live;
+        for (const auto succ : llvm::successors(&block)) {
+            const auto& succLive = liveIn[succ];
+            live.insert(succLive.begin(), succLive.end());
+            for (const auto& phi : succ->phis()) {
+                if (auto v = registerValue(phi.getIncomingValueForBlock(&block))) {
+                    live.insert(v);
                 }
+            }
+        }
+        return live;
+    };
 
-                localMapping.erase(prevIns);
-                canBeReused = true;
-                reusable = prevIndex;
-                break;
+    // Going backwards through the blocks converges faster.
+    std::vector<const llvm::BasicBlock *> reversed;
+    for (const auto& block : func) {
+        reversed.insert(reversed.begin(), &block);
+    }
 
-            alreadyUsed:
-                ;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (const auto block : reversed) {
+            auto live = computeLiveOut(*block);
+            for (auto ins = block->rbegin(); ins != block->rend(); ins++) {
+                if (folded.count(&*ins))
+                    continue;
+                live.erase(&*ins);
+                if (llvm::isa<llvm::PHINode>(*ins))
+                    continue;
+                addUses(*ins, live);
             }
 
-            if (!canBeReused) {
-                reusable = nextIndex++;
+            auto& in = liveIn[block];
+            if (in != live) {
+                in = std::move(live);
+                changed = true;
             }
+        }
+    }
 
-            localMapping[&ins] = reusable;
-            varName = localName(reusable);
+    // Values interfere if one is defined while the other is live.
+    std::map<const llvm::Instruction *, ValueSet> interference;
+    auto interfere = [&](const llvm::Instruction *a, const llvm::Instruction *b) {
+        if (a != b) {
+            interference[a].insert(b);
+            interference[b].insert(a);
         }
+    };
 
-        localsAfter.erase(&ins);
+    for (const auto& block : func) {
+        auto live = computeLiveOut(block);
+        for (auto ins = block.rbegin(); ins != block.rend(); ins++) {
+            if (llvm::isa<llvm::PHINode>(*ins))
+                break;
+            if (folded.count(&*ins))
+                continue;
 
-        if (!varName.empty()) {
-            instructions[&ins] = varName;
-            varNames.insert(std::move(varName));
+            if (registerValue(&*ins)) {
+                for (const auto v : live) {
+                    interfere(&*ins, v);
+                }
+                live.erase(&*ins);
+            }
+
+            addUses(*ins, live);
         }
-    }
 
-    if (nextIndex > localCounter) {
-        localCounter = nextIndex;
+        ValueSet phis;
+        for (const auto& phi : block.phis()) {
+            if (registerValue(&phi)) {
+                phis.insert(&phi);
+            }
+        }
+        for (const auto phi : phis) {
+            for (const auto v : live) {
+                interfere(phi, v);
+            }
+            for (const auto other : phis) {
+                interfere(phi, other);
+            }
+        }
     }
 
-    if (localPhiCount > phiCounter) {
-        phiCounter = localPhiCount;
+    // Color greedily in program order. Values flowing into or out of a phi
+    // try to share its register, which saves the copy on the edge.
+    std::map<const llvm::Instruction *, uint32_t> registers;
+    for (const auto& block : func) {
+        for (const auto& ins : block) {
+            if (!registerValue(&ins))
+                continue;
+
+            std::set<uint32_t> taken;
+            for (const auto v : interference[&ins]) {
+                auto it = registers.find(v);
+                if (it != registers.end()) {
+                    taken.insert(it->second);
+                }
+            }
+
+            std::vector<const llvm::Instruction *> related;
+            if (auto phi = llvm::dyn_cast<llvm::PHINode>(&ins)) {
+                for (const auto& v : phi->incoming_values()) {
+                    if (auto r = registerValue(v)) {
+                        related.push_back(r);
+                    }
+                }
+            }
+            for (const auto user : ins.users()) {
+                if (auto phi = llvm::dyn_cast<llvm::PHINode>(user)) {
+                    related.push_back(phi);
+                }
+            }
+
+            auto chosen = 0U;
+            auto found = false;
+            for (const auto r : related) {
+                auto it = registers.find(r);
+                if (it != registers.end() && taken.find(it->second) == taken.end()) {
+                    chosen = it->second;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                while (taken.find(chosen) != taken.end()) {
+                    chosen++;
+                }
+            }
+
+            registers[&ins] = chosen;
+            instructions[&ins] = localName(chosen);
+            varNames.insert(instructions.at(&ins));
+            if (chosen + 1 > numLocals) {
+                numLocals = chosen + 1;
+            }
+            numValues++;
+        }
     }
 }
 
@@ -231,7 +673,7 @@ void FuncCompileCtx::compileHeader(const llvm::Function& func) {
         if (index) {
             content << ",";
         }
-        content << "VAList v";
+        content << "uint v";
     }
 
     content << ") {\n";
@@ -243,13 +685,51 @@ void FuncCompileCtx::compile(const llvm::Function& func) {
     auto i = 0U;
     for (const auto& block : func) {
         blocks[&block] = i++;
-        allocRegisters(block);
+    }
+    if (options.inlineLimit > 0 && func.getInstructionCount() <= options.inlineLimit) {
+        inlineMemory = true;
+    }
+
+    for (const auto& block : func) {
+        for (const auto& ins : block) {
+            if (inlineAccess(ins) != InlineAccess::None || (inlineMemory && llvm::isa<llvm::AllocaInst>(ins))) {
+                numInlined++;
+            }
+            if (auto call = llvm::dyn_cast<llvm::CallInst>(&ins); call && targets.get(call)) {
+                numGuarded++;
+            }
+        }
     }
 
-    for (i = 0U; i < phiCounter; i++) {
-        varNames.insert("p" + std::to_string(i));
+    findFoldable(func);
+    allocRegisters(func);
+
+    // Variadic arguments are passed in a block big enough for any call here.
+    for (const auto& block : func) {
+        for (const auto& ins : block) {
+            if (auto call = llvm::dyn_cast<llvm::CallInst>(&ins); call && call->getFunctionType()->isVarArg()) {
+                auto extra = call->arg_size() - call->getFunctionType()->getNumParams();
+                varArgsSize = std::max<uint32_t>(varArgsSize, extra * 4);
+            }
+        }
     }
 
+    usesStack = varArgsSize > 0 || std::any_of(func.begin(), func.end(), [](const llvm::BasicBlock& block) {
+        return std::any_of(block.begin(), block.end(), [](const llvm::Instruction& ins) {
+            return ins.getOpcode() == llvm::Instruction::Alloca;
+        });
+    });
+
+    // The body decides which control variables are needed, so compile it
+    // before the declarations.
+    std::ostringstream body;
+    content.swap(body);
+    structured = compileStructured(func);
+    if (!structured) {
+        compileDispatcher(func);
+    }
+    content.swap(body);
+
     if (!varNames.empty()) {
         i = 0U;
         content << "uint ";
@@ -260,118 +740,420 @@ void FuncCompileCtx::compile(const llvm::Function& func) {
         content << ";\n";
     }
 
-    auto hasOtherBlocks = ++func.begin() != func.end();
+    if (!structured) {
+        content << "uint label;\n";
+    } else if (usesLabel) {
+        content << "uint label=0;\n";
+    }
+
+    if (usesStack) content << "uint s=stack;\n";
+    if (varArgsSize > 0) content << "uint va=Alloca(" << varArgsSize << ",4);\n";
 
-    if (hasOtherBlocks) {
-        content << "uint label,lastLabel;\n";
+    auto code = body.str();
+    content << code;
+
+    // makes gzdoom happy to have return statement here
+    if (structured && func.getReturnType()->isSized()) {
+        auto lastLine = code.rfind('\n', code.size() - 2);
+        lastLine = lastLine == std::string::npos ? 0 : lastLine + 1;
+        if (code.compare(lastLine, 6, "return") != 0) {
+            content << "return 0;\n";
+        }
     }
 
-    usesStack = std::any_of(func.begin(), func.end(), [](const llvm::BasicBlock& block) {
-        return std::any_of(block.begin(), block.end(), [](const llvm::Instruction& ins) {
-            if (ins.getOpcode() == llvm::Instruction::Alloca)
-                return true;
+    content << "}\n";
+}
 
-            if (ins.getOpcode() == llvm::Instruction::Call) {
-                auto& callIns = llvm::cast<llvm::CallInst>(ins);
+void FuncCompileCtx::compileDispatcher(const llvm::Function& func) {
+    compileBlock(func.getEntryBlock());
+    compileTerminator(*func.getEntryBlock().getTerminator());
+
+    content << "while(1)switch(label) {\n";
 
-                if (auto f = callIns.getCalledFunction()) {
-                    if (f->getName().equals("llvm.va_start"))
-                        return true;
+    auto i = 0U;
+    for (const auto& block : func) {
+        if (!block.isEntryBlock()) {
+            content << "case " << i << ":\n";
+            compileBlock(block);
+            compileTerminator(*block.getTerminator());
+        }
+        i++;
+    }
+    content << "}\n";
+    content << "Unreachable();\n";
+
+    // makes gzdoom happy to have return statement here
+    if (func.getReturnType()->isSized()) {
+        content << "return 0;\n";
+    }
+}
+
+bool FuncCompileCtx::compileStructured(const llvm::Function& func) {
+    Structurizer structurizer(func);
+    if (!structurizer.isReducible())
+        return false;
+
+    auto tree = structurizer.structure();
+
+    // Jumps that cannot leave through an existing construct get their region
+    // wrapped in one. That changes how other jumps leave, so start over until
+    // no more regions are wrapped.
+    std::string code;
+    do {
+        needsRetry = false;
+        usesLabel = false;
+        code = compileStmt(*tree, Target{Target::None});
+    } while (needsRetry);
+
+    content << code;
+    return true;
+}
+
+std::string FuncCompileCtx::compileStmt(const Stmt& stmt, Target next) {
+    std::ostringstream code;
+    content.swap(code);
+    compileStmtInto(stmt, next);
+    content.swap(code);
+    return code.str();
+}
+
+void FuncCompileCtx::compileStmtInto(const Stmt& stmt, Target next) {
+    switch (stmt.kind) {
+        case StmtKind::Seq: {
+            auto n = stmt.children.size();
+            for (auto i = 0U; i < n; i++) {
+                compileStmtInto(*stmt.children[i], i + 1 < n ? Target{Target::Fallthrough} : next);
+            }
+            break;
+        }
+
+        case StmtKind::Code: {
+            compileBlock(*stmt.block);
+            break;
+        }
+
+        case StmtKind::Edge: {
+            compileEdge(stmt.from, stmt.block);
+            if (stmt.edge == EdgeKind::Merge) {
+                compileJump(Target{Target::Merge, stmt.block}, next);
+            } else if (stmt.edge == EdgeKind::Back) {
+                compileJump(Target{Target::Back, stmt.block}, next);
+            }
+            break;
+        }
+
+        case StmtKind::If: {
+            const auto& ins = llvm::cast<llvm::BranchInst>(*stmt.block->getTerminator());
+            auto cond = getArgument(ins.getCondition());
+            auto thenArm = compileStmt(*stmt.children[0], next);
+            auto elseArm = compileStmt(*stmt.children[1], next);
+
+            if (thenArm.empty()) {
+                if (!elseArm.empty()) {
+                    content << "if(!" << getValue(ins.getCondition()) << "){\n" << elseArm << "}\n";
+                }
+            } else {
+                content << "if(" << cond << "){\n" << thenArm << "}\n";
+                if (!elseArm.empty()) {
+                    content << "else{\n" << elseArm << "}\n";
                 }
             }
+            break;
+        }
 
-            return false;
+        case StmtKind::Switch: {
+            const auto& ins = llvm::cast<llvm::SwitchInst>(*stmt.block->getTerminator());
+            auto n = stmt.children.size();
+            if (n == 1) {
+                // Everything goes to the default.
+                compileStmtInto(*stmt.children[0], next);
+                break;
+            }
+
+            constructs.push_back(Construct{Construct::Switch, stmt.block, next, {}});
+            content << "switch(" << getArgument(ins.getCondition()) << "){\n";
+            for (auto i = 0U; i + 1 < n; i++) {
+                for (auto value : stmt.cases[i]) {
+                    content << "case " << value << ":\n";
+                }
+                // Cases must not fall into the next one.
+                compileStmtInto(*stmt.children[i], Target{Target::Fallthrough});
+            }
+            auto defaultArm = compileStmt(*stmt.children[n - 1], next);
+            if (!defaultArm.empty()) {
+                content << "default:\n" << defaultArm;
+            }
+            content << "}\n";
+
+            auto construct = std::move(constructs.back());
+            constructs.pop_back();
+            compileConstructExit(construct, next);
+            break;
+        }
+
+        case StmtKind::Loop: {
+            constructs.push_back(Construct{Construct::Loop, stmt.block, next, {}});
+            content << "while(1){\n";
+            compileStmtInto(*stmt.children[0], Target{Target::Back, stmt.block});
+            content << "}\n";
+
+            auto construct = std::move(constructs.back());
+            constructs.pop_back();
+            compileConstructExit(construct, next);
+            break;
+        }
+
+        case StmtKind::Block: {
+            Target follow{Target::Merge, stmt.block};
+            if (blockConstructs.find(stmt.block) == blockConstructs.end()) {
+                constructs.push_back(Construct{Construct::Scope, stmt.block, follow, {}});
+                compileStmtInto(*stmt.children[0], follow);
+                constructs.pop_back();
+                break;
+            }
+
+            constructs.push_back(Construct{Construct::Block, stmt.block, follow, {}});
+            content << "do{\n";
+            compileStmtInto(*stmt.children[0], follow);
+            content << "}while(0);\n";
+
+            auto construct = std::move(constructs.back());
+            constructs.pop_back();
+            compileConstructExit(construct, Target{Target::Fallthrough});
+            break;
+        }
+
+        case StmtKind::Return: {
+            compileReturn(llvm::cast<llvm::ReturnInst>(*stmt.block->getTerminator()));
+            break;
+        }
+
+        case StmtKind::Unreachable: {
+            content << "Unreachable();\n";
+            break;
+        }
+    }
+}
+
+void FuncCompileCtx::compileEdge(const llvm::BasicBlock *from, const llvm::BasicBlock *to) {
+    // Phis take the values coming along this edge. The copies happen in
+    // parallel, so a destination is only written once no other copy needs
+    // to read it.
+    std::vector<std::pair<std::string, std::string>> copies;
+    for (const auto& phi : to->phis()) {
+        if (phi.use_empty())
+            continue;
+
+        auto dst = getValue(&phi);
+        auto src = getValue(phi.getIncomingValueForBlock(from));
+        if (dst != src) {
+            copies.emplace_back(std::move(dst), std::move(src));
+        }
+    }
+
+    while (!copies.empty()) {
+        auto it = std::find_if(copies.begin(), copies.end(), [&](const auto& copy) {
+            return std::none_of(copies.begin(), copies.end(), [&](const auto& other) {
+                return other.second == copy.first;
+            });
         });
-    });
 
-    if (usesStack) content << "uint s=stack;\n";
+        if (it != copies.end()) {
+            content << it->first << "=" << it->second << ";\n";
+            copies.erase(it);
+        } else {
+            // Only cycles are left, so break one with a temporary.
+            auto saved = copies.front().first;
+            content << "p=" << saved << ";\n";
+            varNames.insert("p");
+            for (auto& copy : copies) {
+                if (copy.second == saved) {
+                    copy.second = "p";
+                }
+            }
+        }
+    }
+}
 
-    compileBlock(func.getEntryBlock());
+void FuncCompileCtx::compileBranch(const llvm::BasicBlock *from, const llvm::BasicBlock *to) {
+    compileEdge(from, to);
+    content << "label=" << blocks.at(to) << ";\n";
+}
 
-    if (hasOtherBlocks) {
-        content << "while(1)switch(label) {\n";
+JumpAction FuncCompileCtx::resolveJump(Target target, Target next) {
+    if (target == next)
+        return JumpAction{JumpAction::Nothing};
 
-        i = 0U;
-        for (const auto& block : func) {
-            if (!block.isEntryBlock()) {
-                content << "case " << i << ":\n";
-                compileBlock(block);
+    for (auto i = constructs.size(); i-- > 0; ) {
+        const auto& construct = constructs[i];
+
+        if (construct.kind == Construct::Scope) {
+            if (target.kind == Target::Merge && target.block == construct.block) {
+                // Nothing in the region can be left to get here, so the
+                // region needs a construct of its own.
+                blockConstructs.insert(construct.block);
+                needsRetry = true;
+                return JumpAction{JumpAction::Break};
             }
-            i++;
+            continue;
         }
-        content << "}\n";
-        content << "Unreachable();\n";
 
-        // makes gzdoom happy to have return statement here
-        if (func.getReturnType()->isSized()) {
-            content << "return 0;\n";
+        if (construct.landing == target)
+            return JumpAction{JumpAction::Break};
+
+        if (target.kind == Target::Back) {
+            // Switches don't catch continue, but loops do.
+            for (auto j = i + 1; j-- > 0; ) {
+                const auto& loop = constructs[j];
+                if (loop.kind == Construct::Loop && loop.block == target.block)
+                    return JumpAction{JumpAction::Continue};
+                if (loop.kind == Construct::Loop || loop.kind == Construct::Block)
+                    break;
+            }
         }
+
+        // Leave this construct and decide what to do from there.
+        return JumpAction{JumpAction::Escape, i};
     }
 
-    content << "}\n";
+    fprintf(stderr, "Jump has nowhere to go\n");
+    exit(EXIT_FAILURE);
 }
 
-void FuncCompileCtx::compileBlock(const llvm::BasicBlock& block) {
-    auto it = block.begin();
-    auto ie = block.end();
+static void addPending(Construct& construct, Target target) {
+    if (std::find(construct.pending.begin(), construct.pending.end(), target) == construct.pending.end()) {
+        construct.pending.push_back(target);
+    }
+}
 
-    auto phiCount = 0U;
-    std::vector<const llvm::Instruction *> phiMapping;
-    for (; it != ie; it++) {
-        const auto& ins = *it;
-        if (llvm::isa<llvm::PHINode>(ins)) {
-            content << "p" << phiCount++ << "=";
-            compileValue(ins);
-            content << ";\n";
-            phiMapping.push_back(&ins);
-        } else {
+void FuncCompileCtx::compileJump(Target target, Target next) {
+    auto action = resolveJump(target, next);
+    switch (action.kind) {
+        case JumpAction::Nothing:
+            break;
+
+        case JumpAction::Break:
+            content << "break;\n";
+            break;
+
+        case JumpAction::Continue:
+            content << "continue;\n";
+            break;
+
+        case JumpAction::Escape:
+            usesLabel = true;
+            content << "label=" << blocks.at(target.block) << ";\n";
+            content << "break;\n";
+            addPending(constructs[action.construct], target);
             break;
+    }
+}
+
+void FuncCompileCtx::compileConstructExit(Construct& construct, Target next) {
+    if (construct.pending.empty())
+        return;
+
+    std::vector<JumpAction> actions;
+    auto allEscape = true;
+    for (const auto& target : construct.pending) {
+        actions.push_back(resolveJump(target, next));
+        if (actions.back().kind != JumpAction::Escape) {
+            allEscape = false;
         }
     }
 
-    auto i = 0U;
-    for (auto ins : phiMapping) {
-        content << getValue(ins) << "=p" << i++ << ";\n";
+    if (allEscape) {
+        content << "if(label)break;\n";
+        for (auto i = 0U; i < actions.size(); i++) {
+            addPending(constructs[actions[i].construct], construct.pending[i]);
+        }
+        return;
     }
 
+    for (auto i = 0U; i < actions.size(); i++) {
+        auto label = blocks.at(construct.pending[i].block);
+        switch (actions[i].kind) {
+            case JumpAction::Nothing:
+                content << "if(label==" << label << ")label=0;\n";
+                break;
+
+            case JumpAction::Break:
+                content << "if(label==" << label << "){label=0;break;}\n";
+                break;
+
+            case JumpAction::Continue:
+                content << "if(label==" << label << "){label=0;continue;}\n";
+                break;
+
+            case JumpAction::Escape:
+                content << "if(label==" << label << ")break;\n";
+                addPending(constructs[actions[i].construct], construct.pending[i]);
+                break;
+        }
+    }
+}
+
+void FuncCompileCtx::compileBlock(const llvm::BasicBlock& block) {
+    auto it = block.begin();
+    auto ie = block.end();
+
+    // Phis are assigned on the edges leading here.
     for (; it != ie; it++) {
-        compileIns(*it);
+        if (llvm::isa<llvm::PHINode>(*it) || it->isTerminator())
+            continue;
+
+        if (folded.count(&*it)) {
+            std::ostringstream expr;
+            content.swap(expr);
+            compileValue(*it);
+            content.swap(expr);
+
+            auto str = expr.str();
+            instructions[&*it] = isAtom(str) ? str : "(" + str + ")";
+        } else {
+            compileIns(*it);
+        }
     }
 }
 
 void FuncCompileCtx::compileIns(const llvm::Instruction& ins) {
-    if (ins.isTerminator()) {
-        compileTerminator(ins);
-    } else {
-        if (ins.users().begin() != ins.users().end()) {
-            content << getValue(&ins) << "=";
+    if (inlineMemory && llvm::isa<llvm::AllocaInst>(ins)) {
+        compileAlloca(llvm::cast<llvm::AllocaInst>(ins));
+        return;
+    }
+
+    if (auto call = llvm::dyn_cast<llvm::CallInst>(&ins)) {
+        if (call->getFunctionType()->isVarArg()) {
+            compileVarArgs(*call);
         }
-        compileValue(ins);
-        content << ";\n";
+        if (auto guesses = targets.get(call)) {
+            compileGuardedCall(*call, *guesses);
+            return;
+        }
+    }
+
+    if (ins.users().begin() != ins.users().end()) {
+        content << getValue(&ins) << "=";
     }
+    compileValue(ins);
+    content << ";\n";
 }
 
 void FuncCompileCtx::compileTerminator(const llvm::Instruction& baseIns) {
     switch (baseIns.getOpcode()) {
         case llvm::Instruction::Ret: {
-            const auto& ins = llvm::cast<llvm::ReturnInst>(baseIns);
-            auto value = ins.getReturnValue();
-
-            if (usesStack) content << "stack=s;\n";
-            content << "return";
-            if (value != nullptr) {
-                content << " " << getValue(value);
-            }
-            content << ";\n";
-
+            compileReturn(llvm::cast<llvm::ReturnInst>(baseIns));
             break;
         }
 
         case llvm::Instruction::Br: {
             const auto& ins = llvm::cast<llvm::BranchInst>(baseIns);
+            auto block = ins.getParent();
 
-            content << "lastLabel=label;\n";
-            if (ins.isConditional()) {
+            if (ins.isUnconditional()) {
+                compileBranch(block, ins.getSuccessor(0));
+            } else if (!llvm::isa<llvm::PHINode>(ins.getSuccessor(0)->front()) &&
+                       !llvm::isa<llvm::PHINode>(ins.getSuccessor(1)->front())) {
                 content << "label=";
                 content << getValue(ins.getCondition());
                 content << "?";
@@ -380,9 +1162,11 @@ void FuncCompileCtx::compileTerminator(const llvm::Instruction& baseIns) {
                 content << blocks.at(ins.getSuccessor(1));
                 content << ";\n";
             } else {
-                content << "label=";
-                content << blocks.at(ins.getSuccessor(0));
-                content << ";\n";
+                content << "if(" << getArgument(ins.getCondition()) << "){\n";
+                compileBranch(block, ins.getSuccessor(0));
+                content << "}else{\n";
+                compileBranch(block, ins.getSuccessor(1));
+                content << "}\n";
             }
             break;
         }
@@ -390,15 +1174,16 @@ void FuncCompileCtx::compileTerminator(const llvm::Instruction& baseIns) {
         case llvm::Instruction::Switch: {
             const auto& ins = llvm::cast<llvm::SwitchInst>(baseIns);
 
-            content << "lastLabel=label;\n";
-            content << "switch(" << getValue(ins.getCondition()) << "){\n";
+            auto block = ins.getParent();
+
+            content << "switch(" << getArgument(ins.getCondition()) << "){\n";
             for (const auto& c : ins.cases()) {
                 content << "case " << c.getCaseValue()->getZExtValue() << ":\n";
-                content << "label=" << blocks.at(c.getCaseSuccessor()) << ";\n";
+                compileBranch(block, c.getCaseSuccessor());
                 content << "break;\n";
             }
             content << "default:\n";
-            content << "label=" << blocks.at(ins.getDefaultDest()) << ";\n";
+            compileBranch(block, ins.getDefaultDest());
             content << "}\n";
             break;
         }
@@ -419,10 +1204,363 @@ void FuncCompileCtx::compileTerminator(const llvm::Instruction& baseIns) {
     }
 }
 
+void FuncCompileCtx::compileReturn(const llvm::ReturnInst& ins) {
+    auto value = ins.getReturnValue();
+
+    if (usesStack) content << "stack=s;\n";
+    content << "return";
+    if (value != nullptr) {
+        content << " " << getArgument(value);
+    }
+    content << ";\n";
+}
+
+bool FuncCompileCtx::constantAddress(const llvm::Value *ptr, uint32_t& out) {
+    if (!llvm::isa<llvm::Constant>(ptr))
+        return false;
+    out = std::stoul(getValue(ptr));
+    return true;
+}
+
+bool FuncCompileCtx::isAligned(const llvm::Value *ptr, llvm::Align align, uint32_t bytes) {
+    uint32_t addr;
+    if (constantAddress(ptr, addr)) {
+        return addr % bytes == 0;
+    }
+    return std::max(align, ptr->getPointerAlignment(layout)).value() >= bytes;
+}
+
+InlineAccess FuncCompileCtx::inlineAccess(const llvm::Instruction& ins) {
+    const llvm::Value *ptr;
+    llvm::Type *type;
+    llvm::Align align;
+    if (auto load = llvm::dyn_cast<llvm::LoadInst>(&ins)) {
+        ptr = load->getPointerOperand();
+        type = load->getType();
+        align = load->getAlign();
+    } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(&ins)) {
+        ptr = store->getPointerOperand();
+        type = store->getValueOperand()->getType();
+        align = store->getAlign();
+    } else {
+        return InlineAccess::None;
+    }
+
+    if (getField(ptr) || getTable(ptr))
+        return InlineAccess::None;
+
+    auto bitWidth = layout.getTypeSizeInBits(type).getFixedValue();
+    uint32_t addr;
+
+    switch (options.memoryModel) {
+        case MemoryModel::Words:
+            // Aligned words, and loads of parts of a known word, are always
+            // cheaper than the helpers.
+            if (bitWidth == 32 && isAligned(ptr, align, 4))
+                return InlineAccess::Word;
+            if (bitWidth != 8 && bitWidth != 16)
+                return InlineAccess::None;
+            if (constantAddress(ptr, addr)) {
+                if ((addr & 3) + bitWidth / 8 > 4)
+                    return InlineAccess::None;
+                return llvm::isa<llvm::LoadInst>(ins) || inlineMemory ? InlineAccess::WordPart : InlineAccess::None;
+            }
+            if (!inlineMemory)
+                return InlineAccess::None;
+            return bitWidth == 8 || isAligned(ptr, align, 2) ? InlineAccess::WordPart : InlineAccess::None;
+
+        case MemoryModel::Bytes:
+            if (!inlineMemory)
+                return InlineAccess::None;
+            // Loading a bool needs the helper to normalize it.
+            if (bitWidth == 1 && llvm::isa<llvm::LoadInst>(ins))
+                return InlineAccess::None;
+            return InlineAccess::Bytes;
+    }
+
+    return InlineAccess::None;
+}
+
+bool FuncCompileCtx::repeatsOperand(const llvm::Instruction& user, const llvm::Value *value) {
+    // Guarded calls compare the function pointer against each guess.
+    if (auto call = llvm::dyn_cast<llvm::CallInst>(&user)) {
+        return call->getCalledOperand() == value && targets.get(call) != nullptr;
+    }
+
+    auto access = inlineAccess(user);
+    if (access == InlineAccess::None || access == InlineAccess::Word)
+        return false;
+
+    const llvm::Value *ptr;
+    llvm::Type *type;
+    if (auto load = llvm::dyn_cast<llvm::LoadInst>(&user)) {
+        ptr = load->getPointerOperand();
+        type = load->getType();
+    } else {
+        auto& store = llvm::cast<llvm::StoreInst>(user);
+        ptr = store.getPointerOperand();
+        type = store.getValueOperand()->getType();
+    }
+
+    if (access == InlineAccess::WordPart)
+        return ptr == value;
+
+    // Every byte after the first needs the address and value again.
+    return layout.getTypeSizeInBits(type).getFixedValue() > 8;
+}
+
+std::string FuncCompileCtx::wordIndex(const llvm::Value *ptr) {
+    uint32_t addr;
+    if (constantAddress(ptr, addr)) {
+        return std::to_string(addr >> 2);
+    }
+    return getValue(ptr) + ">>2";
+}
+
+std::string FuncCompileCtx::wordShift(const llvm::Value *ptr, uint64_t bitWidth) {
+    uint32_t addr;
+    if (constantAddress(ptr, addr)) {
+        auto shift = (addr & 3) * 8;
+        return shift ? std::to_string(shift) : "";
+    }
+    // Halfwords are known to be aligned.
+    return "((" + getValue(ptr) + (bitWidth == 8 ? "&3U" : "&2U") + ")<<3)";
+}
+
+std::string FuncCompileCtx::byteAddress(const llvm::Value *ptr, uint32_t offset) {
+    uint32_t addr;
+    if (constantAddress(ptr, addr)) {
+        return std::to_string(addr + offset);
+    }
+    if (offset == 0) {
+        return getArgument(ptr);
+    }
+    return getValue(ptr) + "+" + std::to_string(offset) + "U";
+}
+
+void FuncCompileCtx::compileLoad(const llvm::LoadInst& ins) {
+    auto ptr = ins.getPointerOperand();
+    if (auto field = getField(ptr)) {
+        content << *field;
+        return;
+    }
+    if (auto table = getTable(ptr)) {
+        // Elements are zero-extended, like loads from memory.
+        content << "uint(" << table->field << "[" << getArgument(ptr) << "])";
+        return;
+    }
+
+    auto bitWidth = layout.getTypeSizeInBits(ins.getAccessType()).getFixedValue();
+    switch (inlineAccess(ins)) {
+        case InlineAccess::Word: {
+            content << "memory[" << wordIndex(ptr) << "]";
+            return;
+        }
+
+        case InlineAccess::WordPart: {
+            auto shift = wordShift(ptr, bitWidth);
+            content << "(memory[" << wordIndex(ptr) << "]";
+            if (!shift.empty()) {
+                content << ">>" << shift;
+            }
+            content << ")&" << ((1U << bitWidth) - 1) << "U";
+            return;
+        }
+
+        case InlineAccess::Bytes: {
+            for (auto i = 0U; i < bitWidth / 8; i++) {
+                if (i) {
+                    content << "|(memory[" << byteAddress(ptr, i) << "]<<" << i * 8 << ")";
+                } else {
+                    content << "memory[" << byteAddress(ptr, i) << "]";
+                }
+            }
+            return;
+        }
+
+        case InlineAccess::None:
+            break;
+    }
+
+    switch (bitWidth) {
+        case 1:
+            content << "Load1(";
+            break;
+        case 8:
+            content << "Load8(";
+            break;
+        case 16:
+            content << "Load16(";
+            break;
+        case 32:
+            content << "Load32(";
+            break;
+        default:
+            fprintf(stderr, "Unsupported load width %lu\n", bitWidth);
+            exit(EXIT_FAILURE);
+    }
+    content << getArgument(ptr) << ")";
+}
+
+void FuncCompileCtx::compileStore(const llvm::StoreInst& ins) {
+    auto ptr = ins.getPointerOperand();
+    auto value = ins.getValueOperand();
+    if (auto field = getField(ptr)) {
+        content << *field << "=" << getArgument(value);
+        return;
+    }
+
+    auto bitWidth = layout.getTypeSizeInBits(ins.getAccessType()).getFixedValue();
+    switch (inlineAccess(ins)) {
+        case InlineAccess::Word: {
+            content << "memory[" << wordIndex(ptr) << "]=" << getArgument(value);
+            return;
+        }
+
+        case InlineAccess::WordPart: {
+            auto index = wordIndex(ptr);
+            auto shift = wordShift(ptr, bitWidth);
+            auto mask = (1U << bitWidth) - 1;
+            content << "memory[" << index << "]=(memory[" << index << "]&";
+            uint32_t addr;
+            if (constantAddress(ptr, addr)) {
+                content << ~(mask << (addr & 3) * 8) << "U";
+            } else {
+                content << "~(" << mask << "U<<" << shift << ")";
+            }
+            content << ")|((" << getValue(value) << "&" << mask << "U)";
+            if (!shift.empty()) {
+                content << "<<" << shift;
+            }
+            content << ")";
+            return;
+        }
+
+        case InlineAccess::Bytes: {
+            auto v = getValue(value);
+            auto bytes = std::max<uint32_t>(bitWidth / 8, 1);
+            for (auto i = 0U; i < bytes; i++) {
+                if (i) {
+                    content << ";\nmemory[" << byteAddress(ptr, i) << "]=" << v << ">>" << i * 8;
+                } else {
+                    content << "memory[" << byteAddress(ptr, i) << "]=" << getArgument(value);
+                }
+            }
+            return;
+        }
+
+        case InlineAccess::None:
+            break;
+    }
+
+    switch (bitWidth) {
+        case 1:
+            content << "Store1(";
+            break;
+        case 8:
+            content << "Store8(";
+            break;
+        case 16:
+            content << "Store16(";
+            break;
+        case 32:
+            content << "Store32(";
+            break;
+        default:
+            fprintf(stderr, "Unsupported store width %lu\n", bitWidth);
+            exit(EXIT_FAILURE);
+    }
+
+    content << getArgument(ptr);
+    content << ",";
+    content << getArgument(value);
+    content << ")";
+}
+
+void FuncCompileCtx::compileArguments(const llvm::CallInst& ins, bool first) {
+    auto t = ins.getFunctionType();
+    auto numParams = t->getNumParams();
+    auto numArgs = ins.arg_size();
+
+    unsigned int index;
+    for (index = 0U; index < numParams; index++) {
+        if (!first || index) content << ",";
+        content << getArgument(ins.getArgOperand(index));
+    }
+
+    if (t->isVarArg()) {
+        if (!first || index) content << ",";
+        content << (numArgs > numParams ? "va" : "0U");
+    }
+
+    content << ")";
+}
+
+void FuncCompileCtx::compileVarArgs(const llvm::CallInst& ins) {
+    auto numParams = ins.getFunctionType()->getNumParams();
+    for (auto index = numParams; index < ins.arg_size(); index++) {
+        content << "Store32(va";
+        if (index > numParams) {
+            content << "+" << (index - numParams) * 4 << "U";
+        }
+        content << "," << getArgument(ins.getArgOperand(index)) << ");\n";
+    }
+}
+
+void FuncCompileCtx::compileGuardedCall(const llvm::CallInst& ins, const std::vector<const llvm::Function *>& guesses) {
+    auto callee = getValue(ins.getCalledOperand());
+    auto result = ins.use_empty() ? std::string() : getValue(&ins) + "=";
+
+    for (auto i = 0U; i < guesses.size(); i++) {
+        content << (i ? "}else if(" : "if(") << callee << "==" << memory.getFuncIndex(guesses[i]) << "U){\n";
+        content << result << "func_" << guesses[i]->getName().str() << "(";
+        compileArguments(ins, true);
+        content << ";\n";
+    }
+
+    content << "}else{\n";
+    content << result << memory.getDispatcher(ins.getFunctionType()) << "(" << callee;
+    compileArguments(ins, false);
+    content << ";\n}\n";
+}
+
+void FuncCompileCtx::compileAlloca(const llvm::AllocaInst& ins) {
+    auto size = ins.getAllocationSize(layout);
+    if (size == std::nullopt) {
+        fprintf(stderr, "Bad alloca\n");
+        exit(EXIT_FAILURE);
+    }
+    auto bytes = size.value();
+    auto al = ins.getAlign().value();
+
+    if (al > 1) {
+        content << "stack=(stack-" << bytes << "U)&" << (uint32_t) ~(al - 1) << "U;\n";
+    } else {
+        content << "stack-=" << bytes << "U;\n";
+    }
+
+    if (!ins.use_empty()) {
+        content << getValue(&ins) << "=stack;\n";
+    }
+}
+
 void FuncCompileCtx::compileValue(const llvm::Instruction& baseIns) {
     if (baseIns.isBinaryOp()) {
         const auto& ins = llvm::cast<llvm::BinaryOperator>(baseIns);
         auto opcode = ins.getOpcode();
+        if (actsUnsigned(ins)) {
+            switch (opcode) {
+                case llvm::Instruction::BinaryOps::SDiv:
+                    opcode = llvm::Instruction::BinaryOps::UDiv;
+                    break;
+                case llvm::Instruction::BinaryOps::SRem:
+                    opcode = llvm::Instruction::BinaryOps::URem;
+                    break;
+                default:
+                    opcode = llvm::Instruction::BinaryOps::LShr;
+                    break;
+            }
+        }
 
         bool lhsSigned, rhsSigned;
         switch (opcode) {
@@ -462,6 +1600,9 @@ void FuncCompileCtx::compileValue(const llvm::Instruction& baseIns) {
 
         if (layout.getTypeSizeInBits(ins.getType()) == 32) {
             needsTruncation = false;
+        } else if (llvm::isa<llvm::OverflowingBinaryOperator>(ins) && ins.hasNoUnsignedWrap()) {
+            // The result already fits.
+            needsTruncation = false;
         }
 
         if (needsTruncation) {
@@ -531,56 +1672,12 @@ void FuncCompileCtx::compileValue(const llvm::Instruction& baseIns) {
     } else {
         switch (baseIns.getOpcode()) {
             case llvm::Instruction::Load: {
-                auto& ins = llvm::cast<llvm::LoadInst>(baseIns);
-                auto bitWidth = layout.getTypeSizeInBits(ins.getAccessType()).getFixedValue();
-                switch (bitWidth) {
-                    case 1:
-                        content << "Load1(";
-                        break;
-                    case 8:
-                        content << "Load8(";
-                        break;
-                    case 16:
-                        content << "Load16(";
-                        break;
-                    case 32:
-                        content << "Load32(";
-                        break;
-                    default:
-                        fprintf(stderr, "Unsupported load width %lu\n", bitWidth);
-                        exit(EXIT_FAILURE);
-                }
-                content << getValue(ins.getOperand(0)) << ")";
-
+                compileLoad(llvm::cast<llvm::LoadInst>(baseIns));
                 break;
             }
 
             case llvm::Instruction::Store: {
-                auto& ins = llvm::cast<llvm::StoreInst>(baseIns);
-                auto bitWidth = layout.getTypeSizeInBits(ins.getAccessType()).getFixedValue();
-                switch (bitWidth) {
-                    case 1:
-                        content << "Store1(";
-                        break;
-                    case 8:
-                        content << "Store8(";
-                        break;
-                    case 16:
-                        content << "Store16(";
-                        break;
-                    case 32:
-                        content << "Store32(";
-                        break;
-                    default:
-                        fprintf(stderr, "Unsupported store width %lu\n", bitWidth);
-                        exit(EXIT_FAILURE);
-                }
-
-                content << getValue(ins.getPointerOperand());
-                content << ",";
-                content << getValue(ins.getValueOperand());
-                content << ")";
-
+                compileStore(llvm::cast<llvm::StoreInst>(baseIns));
                 break;
             }
 
@@ -588,6 +1685,10 @@ void FuncCompileCtx::compileValue(const llvm::Instruction& baseIns) {
                 auto& ins = llvm::cast<llvm::GetElementPtrInst>(baseIns);
                 llvm::APInt constantOffset(32, 0);
 
+                // Pointers into tables count elements instead of bytes.
+                auto table = getTable(&ins);
+                auto unit = table ? table->elementBytes : 1;
+
                 content << getValue(ins.getOperand(0));
 
                 llvm::MapVector<llvm::Value *, llvm::APInt> offsets;
@@ -597,7 +1698,7 @@ void FuncCompileCtx::compileValue(const llvm::Instruction& baseIns) {
                 }
 
                 for (auto& [val, scale] : offsets) {
-                    auto scaleVal = scale.getSExtValue();
+                    auto scaleVal = scale.getSExtValue() / unit;
                     content << "+" << getValue(val);
                     if (scaleVal > 1) {
                         content << "*" << scaleVal;
@@ -607,7 +1708,7 @@ void FuncCompileCtx::compileValue(const llvm::Instruction& baseIns) {
                     }
                 }
 
-                auto c = constantOffset.getSExtValue();
+                auto c = constantOffset.getSExtValue() / unit;
                 if (c > 0) {
                     content << "+" << c << "U";
                 } else if (c < 0) {
@@ -619,15 +1720,17 @@ void FuncCompileCtx::compileValue(const llvm::Instruction& baseIns) {
 
             case llvm::Instruction::Call: {
                 auto& ins = llvm::cast<llvm::CallInst>(baseIns);
-                auto needsSelf = false;
+                auto isIndirect = false;
 
                 if (auto f = ins.getCalledFunction()) {
                     auto name = f->getName();
                     if (name.starts_with("llvm.")) {
                         if (name.equals("llvm.va_start")) {
-                            content << "v.Start";
+                            content << "Store32(" << getArgument(ins.getArgOperand(0)) << ",v)";
+                            break;
                         } else if (name.equals("llvm.va_end")) {
-                            content << "v.End";
+                            content << "Store32(" << getArgument(ins.getArgOperand(0)) << ",0U)";
+                            break;
                         } else if (name.starts_with("llvm.umin.")) {
                             auto rhs = getValue(ins.getArgOperand(1));
                             auto lhs = getValue(ins.getArgOperand(0));
@@ -675,35 +1778,15 @@ void FuncCompileCtx::compileValue(const llvm::Instruction& baseIns) {
                         content << "func_" << name.str();
                     }
                 } else {
-                    content << memory.getFuncPtr(ins.getFunctionType(), getValue(ins.getCalledOperand()));
-                    needsSelf = true;
+                    content << memory.getDispatcher(ins.getFunctionType());
+                    isIndirect = true;
                 }
 
                 content << "(";
-                if (needsSelf) {
-                    content << "self";
-                }
-
-                auto t = ins.getFunctionType();
-                auto numParams = t->getNumParams();
-                auto numArgs = ins.arg_size();
-
-                unsigned int index;
-                for (index = 0U; index < numParams; index++) {
-                    if (needsSelf || index) content << ",";
-                    content << getValue(ins.getArgOperand(index));
-                }
-
-                if (t->isVarArg()) {
-                    if (needsSelf || index) content << ",";
-
-                    content << "VAList.Create(self)";
-                    for (; index < numArgs; index++) {
-                        content << ".Add(" << getValue(ins.getArgOperand(index)) << ")";
-                    }
+                if (isIndirect) {
+                    content << getArgument(ins.getCalledOperand());
                 }
-
-                content << ")";
+                compileArguments(ins, !isIndirect);
 
                 break;
             }
@@ -712,18 +1795,7 @@ void FuncCompileCtx::compileValue(const llvm::Instruction& baseIns) {
                 auto& ins = llvm::cast<llvm::ICmpInst>(baseIns);
                 auto predicate = ins.getPredicate();
 
-                bool isSigned;
-                switch (predicate) {
-                    case llvm::ICmpInst::Predicate::ICMP_SLT:
-                    case llvm::ICmpInst::Predicate::ICMP_SLE:
-                    case llvm::ICmpInst::Predicate::ICMP_SGT:
-                    case llvm::ICmpInst::Predicate::ICMP_SGE:
-                        isSigned = true;
-                        break;
-                    default:
-                        isSigned = false;
-                        break;
-                }
+                bool isSigned = ins.isSigned() && !actsUnsigned(ins);
 
                 if (isSigned) {
                     content << getSignedValue(ins.getOperand(0));
@@ -776,15 +1848,23 @@ void FuncCompileCtx::compileValue(const llvm::Instruction& baseIns) {
             }
 
             case llvm::Instruction::SExt: {
-                content << getSignedValue(baseIns.getOperand(0));
-                truncateValue(baseIns.getType());
+                if (actsUnsigned(baseIns)) {
+                    content << getValue(baseIns.getOperand(0));
+                } else {
+                    content << getSignedValue(baseIns.getOperand(0));
+                    truncateValue(baseIns.getType());
+                }
                 break;
             }
 
             case llvm::Instruction::Trunc:
             case llvm::Instruction::PtrToInt: {
                 content << getValue(baseIns.getOperand(0));
-                truncateValue(baseIns.getType());
+                // Skip the mask if the dropped bits are already clear.
+                auto bits = layout.getTypeSizeInBits(baseIns.getType()).getFixedValue();
+                if (!fitsIn(baseIns.getOperand(0), bits)) {
+                    truncateValue(baseIns.getType());
+                }
                 break;
             }
 
@@ -793,33 +1873,13 @@ void FuncCompileCtx::compileValue(const llvm::Instruction& baseIns) {
                 auto size = ins.getAllocationSize(layout);
                 if (size == std::nullopt) {
                     fprintf(stderr, "Bad alloca\n");
+                    exit(EXIT_FAILURE);
                 }
                 auto al = ins.getAlign();
                 content << "Alloca(" << size.value() << "," << al.value() << ")";
                 break;
             }
 
-            case llvm::Instruction::PHI: {
-                auto& ins = llvm::cast<llvm::PHINode>(baseIns);
-
-                auto v = ins.incoming_values().begin();
-                auto b = ins.blocks().begin();
-                auto num = ins.getNumIncomingValues();
-
-                for (auto i = 0U; i < num; i++) {
-                    if (i) content << ":";
-
-                    // turn last condition into default to make valid ternary chain
-                    if (i + 1 != num) {
-                        content << "lastLabel==" << blocks.at(*b++) << "?";
-                    }
-
-                    content << getValue(*v++);
-                }
-
-                break;
-            }
-
             case llvm::Instruction::Select: {
                 auto& ins = llvm::cast<llvm::SelectInst>(baseIns);
 
@@ -850,13 +1910,46 @@ void FuncCompileCtx::truncateValue(llvm::Type *t) {
     }
 }
 
-void Function::compile(const llvm::Function& func, const llvm::DataLayout& layout, const GlobalMemory& memory) {
-    FuncCompileCtx ctx(layout, memory);
+void Function::compile(const llvm::Function& func, const llvm::DataLayout& layout, const GlobalMemory& memory, const Options& options, const CallTargets& targets) {
+    FuncCompileCtx ctx(layout, memory, options, targets);
     ctx.compile(func);
 
     content = std::move(ctx.content.str());
+    functionName = func.getName().str();
+    stats.structured = ctx.structured;
+    stats.values = ctx.numValues;
+    stats.locals = ctx.numLocals;
+    stats.inlined = ctx.numInlined;
+    stats.guarded = ctx.numGuarded;
 }
 
 const std::string& Function::contents() const {
     return content;
 }
+
+const std::string& Function::name() const {
+    return functionName;
+}
+
+const FunctionStats& Function::statistics() const {
+    return stats;
+}
+
+void Function::save(std::ostream& out) const {
+    out << functionName << "\n";
+    out << stats.structured << " " << stats.values << " " << stats.locals << " " << stats.inlined << " " << stats.guarded << "\n";
+    out << content;
+}
+
+bool Function::load(std::istream& in) {
+    std::getline(in, functionName);
+    in >> stats.structured >> stats.values >> stats.locals >> stats.inlined >> stats.guarded;
+    in.ignore(1);
+    if (in.fail())
+        return false;
+
+    std::ostringstream rest;
+    rest << in.rdbuf();
+    content = rest.str();
+    return true;
+}
@@ -1,6 +1,8 @@
 #ifndef CONVERTER_FUNCTION_H
 #define CONVERTER_FUNCTION_H
 
+#include <cstdint>
+#include <iosfwd>
 #include <string>
 
 namespace llvm {
@@ -8,16 +10,38 @@ namespace llvm {
     class Function;
 }
 
+class CallTargets;
 class GlobalMemory;
+struct Options;
+
+struct FunctionStats {
+    // Whether the control flow was recovered, as opposed to using a dispatch loop.
+    bool structured = false;
+    // How many values needed a variable, and how many locals hold them.
+    uint32_t values = 0U;
+    uint32_t locals = 0U;
+    // Memory accesses written out instead of calling a helper.
+    uint32_t inlined = 0U;
+    // Indirect calls that try likely targets before the dispatcher.
+    uint32_t guarded = 0U;
+};
 
 class Function {
     std::string content;
+    std::string functionName;
+    FunctionStats stats;
 
 public:
-    void compile(const llvm::Function& func, const llvm::DataLayout& layout, const GlobalMemory& memory);
+    void compile(const llvm::Function& func, const llvm::DataLayout& layout, const GlobalMemory& memory, const Options& options, const CallTargets& targets);
     void debugPrint();
 
+    // Write the generated code and statistics to the cache, or read them back.
+    void save(std::ostream& out) const;
+    bool load(std::istream& in);
+
     const std::string& contents() const;
+    const std::string& name() const;
+    const FunctionStats& statistics() const;
 };
 
 #endif
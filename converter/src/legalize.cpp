@@ -0,0 +1,423 @@
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+#include <llvm/ADT/PostOrderIterator.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Local.h>
+
+#include "legalize.hpp"
+
+// Divides a 32-bit value shifted left by up to MAX_EXACT_SHIFT bits, without
+// 64-bit integers. This must match m_fixed.zs.
+static const char *DIV_SHIFTED = "M_DivShifted";
+
+// The runtime divides in doubles, which hold integers of up to 53 bits.
+static constexpr uint64_t MAX_EXACT_SHIFT = 53 - 32;
+
+namespace {
+
+struct Halves {
+    llvm::Value *lo;
+    llvm::Value *hi;
+};
+
+class Legalizer {
+    llvm::Function& f;
+    llvm::IRBuilder<> builder;
+    llvm::IntegerType *i32;
+
+    std::map<const llvm::Value *, Halves> halves;
+    std::vector<std::pair<llvm::PHINode *, Halves>> phis;
+    std::vector<llvm::Instruction *> replaced;
+
+    [[noreturn]] void fail(const llvm::Instruction& ins, const char *message);
+
+    Halves get(const llvm::Value *value);
+    llvm::Value *low(const llvm::Value *value);
+    llvm::Value *unsignedHigh(llvm::Value *a, llvm::Value *b);
+    llvm::Value *signedHigh(llvm::Value *a, llvm::Value *b);
+    bool lowerDivide(llvm::BinaryOperator& ins);
+    void lower(llvm::Instruction& ins);
+
+public:
+    Legalizer(llvm::Function& f);
+
+    void run();
+};
+
+}
+
+static bool isWide(const llvm::Type *t) {
+    return t->isIntegerTy(64);
+}
+
+// Whether a 64-bit value is a sign-extended 32-bit value.
+static bool isSignExtended(const llvm::Value *value) {
+    if (auto c = llvm::dyn_cast<llvm::ConstantInt>(value)) {
+        return c->getValue().isSignedIntN(32);
+    }
+    auto ext = llvm::dyn_cast<llvm::SExtInst>(value);
+    return ext != nullptr && ext->getSrcTy()->getIntegerBitWidth() <= 32;
+}
+
+Legalizer::Legalizer(llvm::Function& f)
+    : f(f)
+    , builder(f.getContext())
+    , i32(llvm::IntegerType::get(f.getContext(), 32)) {}
+
+void Legalizer::fail(const llvm::Instruction& ins, const char *message) {
+    llvm::errs() << f.getName() << ": " << ins << "\n";
+    fprintf(stderr, "%s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+Halves Legalizer::get(const llvm::Value *value) {
+    if (auto c = llvm::dyn_cast<llvm::ConstantInt>(value)) {
+        auto v = c->getZExtValue();
+        return { builder.getInt32(uint32_t(v)), builder.getInt32(uint32_t(v >> 32)) };
+    } else if (llvm::isa<llvm::UndefValue>(value)) {
+        auto undef = llvm::UndefValue::get(i32);
+        return { undef, undef };
+    }
+
+    auto it = halves.find(value);
+    if (it == halves.end() || it->second.hi == nullptr) {
+        llvm::errs() << f.getName() << ": " << *value << "\n";
+        fprintf(stderr, "Unsupported 64-bit value\n");
+        exit(EXIT_FAILURE);
+    }
+    return it->second;
+}
+
+// Get the lower half of a value, which is all a truncated quotient has.
+llvm::Value *Legalizer::low(const llvm::Value *value) {
+    auto it = halves.find(value);
+    if (it != halves.end()) {
+        return it->second.lo;
+    }
+    return get(value).lo;
+}
+
+// The upper half of the product of two unsigned words, from the products of
+// their 16-bit halves.
+llvm::Value *Legalizer::unsignedHigh(llvm::Value *a, llvm::Value *b) {
+    auto al = builder.CreateAnd(a, 0xffff);
+    auto ah = builder.CreateLShr(a, 16);
+    auto bl = builder.CreateAnd(b, 0xffff);
+    auto bh = builder.CreateLShr(b, 16);
+
+    auto ll = builder.CreateMul(al, bl);
+    auto lh = builder.CreateMul(al, bh);
+    auto hl = builder.CreateMul(ah, bl);
+    auto hh = builder.CreateMul(ah, bh);
+
+    auto mid = builder.CreateAdd(builder.CreateLShr(ll, 16), builder.CreateAnd(lh, 0xffff));
+    mid = builder.CreateAdd(mid, builder.CreateAnd(hl, 0xffff));
+
+    auto hi = builder.CreateAdd(hh, builder.CreateLShr(lh, 16));
+    hi = builder.CreateAdd(hi, builder.CreateLShr(hl, 16));
+    return builder.CreateAdd(hi, builder.CreateLShr(mid, 16));
+}
+
+// The upper half of the product of two signed words. A negative operand adds
+// 2^32 times the other operand to the unsigned product.
+llvm::Value *Legalizer::signedHigh(llvm::Value *a, llvm::Value *b) {
+    auto hi = unsignedHigh(a, b);
+    hi = builder.CreateSub(hi, builder.CreateAnd(builder.CreateAShr(a, 31), b));
+    return builder.CreateSub(hi, builder.CreateAnd(builder.CreateAShr(b, 31), a));
+}
+
+// Fixed-point division divides a sign-extended word shifted left, and only
+// keeps the lower half of the quotient. The dividend then fits in a double,
+// which divides it exactly enough to truncate to the right quotient.
+bool Legalizer::lowerDivide(llvm::BinaryOperator& ins) {
+    for (const auto user : ins.users()) {
+        if (!llvm::isa<llvm::TruncInst>(user))
+            return false;
+    }
+
+    auto dividend = ins.getOperand(0);
+    uint64_t shift = 0;
+    if (auto shl = llvm::dyn_cast<llvm::BinaryOperator>(dividend)) {
+        auto amount = llvm::dyn_cast<llvm::ConstantInt>(shl->getOperand(1));
+        if (shl->getOpcode() != llvm::Instruction::Shl || amount == nullptr)
+            return false;
+        shift = amount->getZExtValue();
+        dividend = shl->getOperand(0);
+    }
+    if (shift > MAX_EXACT_SHIFT || !isSignExtended(dividend) || !isSignExtended(ins.getOperand(1)))
+        return false;
+
+    auto module = f.getParent();
+    auto type = llvm::FunctionType::get(i32, { i32, i32, i32 }, false);
+    auto callee = module->getOrInsertFunction(DIV_SHIFTED, type);
+    auto quotient = builder.CreateCall(callee, { get(dividend).lo, builder.getInt32(shift), get(ins.getOperand(1)).lo });
+    halves[&ins] = { quotient, nullptr };
+    return true;
+}
+
+void Legalizer::lower(llvm::Instruction& ins) {
+    auto wideResult = isWide(ins.getType());
+    auto wideOperand = false;
+    for (const auto& op : ins.operands()) {
+        wideOperand |= isWide(op->getType());
+    }
+    if (!wideResult && !wideOperand)
+        return;
+
+    builder.SetInsertPoint(&ins);
+    replaced.push_back(&ins);
+
+    switch (ins.getOpcode()) {
+        case llvm::Instruction::Load: {
+            auto& load = llvm::cast<llvm::LoadInst>(ins);
+            auto ptr = load.getPointerOperand();
+            auto hiAlign = llvm::commonAlignment(load.getAlign(), 4);
+            auto lo = builder.CreateAlignedLoad(i32, ptr, load.getAlign(), load.isVolatile());
+            auto hiPtr = builder.CreateConstGEP1_32(i32, ptr, 1);
+            auto hi = builder.CreateAlignedLoad(i32, hiPtr, hiAlign, load.isVolatile());
+            halves[&ins] = { lo, hi };
+            break;
+        }
+
+        case llvm::Instruction::Store: {
+            auto& store = llvm::cast<llvm::StoreInst>(ins);
+            auto ptr = store.getPointerOperand();
+            if (isWide(ptr->getType()))
+                fail(ins, "Unsupported 64-bit store");
+            auto value = get(store.getValueOperand());
+            auto hiAlign = llvm::commonAlignment(store.getAlign(), 4);
+            builder.CreateAlignedStore(value.lo, ptr, store.getAlign(), store.isVolatile());
+            auto hiPtr = builder.CreateConstGEP1_32(i32, ptr, 1);
+            builder.CreateAlignedStore(value.hi, hiPtr, hiAlign, store.isVolatile());
+            break;
+        }
+
+        case llvm::Instruction::SExt: {
+            auto lo = builder.CreateSExtOrBitCast(ins.getOperand(0), i32);
+            halves[&ins] = { lo, builder.CreateAShr(lo, 31) };
+            break;
+        }
+
+        case llvm::Instruction::ZExt: {
+            auto lo = builder.CreateZExtOrBitCast(ins.getOperand(0), i32);
+            halves[&ins] = { lo, builder.getInt32(0) };
+            break;
+        }
+
+        case llvm::Instruction::Trunc: {
+            auto lo = low(ins.getOperand(0));
+            ins.replaceAllUsesWith(builder.CreateTruncOrBitCast(lo, ins.getType()));
+            break;
+        }
+
+        case llvm::Instruction::Add: {
+            auto a = get(ins.getOperand(0)), b = get(ins.getOperand(1));
+            auto lo = builder.CreateAdd(a.lo, b.lo);
+            auto carry = builder.CreateZExt(builder.CreateICmpULT(lo, a.lo), i32);
+            halves[&ins] = { lo, builder.CreateAdd(builder.CreateAdd(a.hi, b.hi), carry) };
+            break;
+        }
+
+        case llvm::Instruction::Sub: {
+            auto a = get(ins.getOperand(0)), b = get(ins.getOperand(1));
+            auto borrow = builder.CreateZExt(builder.CreateICmpULT(a.lo, b.lo), i32);
+            auto lo = builder.CreateSub(a.lo, b.lo);
+            halves[&ins] = { lo, builder.CreateSub(builder.CreateSub(a.hi, b.hi), borrow) };
+            break;
+        }
+
+        case llvm::Instruction::And:
+        case llvm::Instruction::Or:
+        case llvm::Instruction::Xor: {
+            auto opcode = static_cast<llvm::Instruction::BinaryOps>(ins.getOpcode());
+            auto a = get(ins.getOperand(0)), b = get(ins.getOperand(1));
+            halves[&ins] = { builder.CreateBinOp(opcode, a.lo, b.lo), builder.CreateBinOp(opcode, a.hi, b.hi) };
+            break;
+        }
+
+        case llvm::Instruction::Shl:
+        case llvm::Instruction::LShr:
+        case llvm::Instruction::AShr: {
+            auto amount = llvm::dyn_cast<llvm::ConstantInt>(ins.getOperand(1));
+            if (amount == nullptr)
+                fail(ins, "Unsupported 64-bit shift by a variable amount");
+
+            auto a = get(ins.getOperand(0));
+            auto n = amount->getZExtValue();
+            auto zero = builder.getInt32(0);
+            auto sign = builder.CreateAShr(a.hi, 31);
+            Halves result;
+            if (n >= 64) {
+                auto poison = llvm::PoisonValue::get(i32);
+                result = { poison, poison };
+            } else if (n == 0) {
+                result = a;
+            } else if (ins.getOpcode() == llvm::Instruction::Shl) {
+                if (n < 32) {
+                    auto hi = builder.CreateOr(builder.CreateShl(a.hi, n), builder.CreateLShr(a.lo, 32 - n));
+                    result = { builder.CreateShl(a.lo, n), hi };
+                } else {
+                    result = { zero, builder.CreateShl(a.lo, n - 32) };
+                }
+            } else {
+                auto arithmetic = ins.getOpcode() == llvm::Instruction::AShr;
+                if (n < 32) {
+                    auto lo = builder.CreateOr(builder.CreateLShr(a.lo, n), builder.CreateShl(a.hi, 32 - n));
+                    auto hi = arithmetic ? builder.CreateAShr(a.hi, n) : builder.CreateLShr(a.hi, n);
+                    result = { lo, hi };
+                } else if (arithmetic) {
+                    result = { builder.CreateAShr(a.hi, n - 32), sign };
+                } else {
+                    result = { builder.CreateLShr(a.hi, n - 32), zero };
+                }
+            }
+            halves[&ins] = result;
+            break;
+        }
+
+        case llvm::Instruction::Mul: {
+            auto a = get(ins.getOperand(0)), b = get(ins.getOperand(1));
+            auto lo = builder.CreateMul(a.lo, b.lo);
+            if (isSignExtended(ins.getOperand(0)) && isSignExtended(ins.getOperand(1))) {
+                // A product of two words, as in fixed-point multiplication.
+                halves[&ins] = { lo, signedHigh(a.lo, b.lo) };
+            } else {
+                auto hi = unsignedHigh(a.lo, b.lo);
+                hi = builder.CreateAdd(hi, builder.CreateMul(a.lo, b.hi));
+                hi = builder.CreateAdd(hi, builder.CreateMul(a.hi, b.lo));
+                halves[&ins] = { lo, hi };
+            }
+            break;
+        }
+
+        case llvm::Instruction::SDiv: {
+            if (!lowerDivide(llvm::cast<llvm::BinaryOperator>(ins)))
+                fail(ins, "Unsupported 64-bit division");
+            break;
+        }
+
+        case llvm::Instruction::ICmp: {
+            auto& cmp = llvm::cast<llvm::ICmpInst>(ins);
+            auto a = get(cmp.getOperand(0)), b = get(cmp.getOperand(1));
+            auto pred = cmp.getPredicate();
+            llvm::Value *result;
+            if (pred == llvm::ICmpInst::ICMP_EQ) {
+                result = builder.CreateAnd(builder.CreateICmpEQ(a.lo, b.lo), builder.CreateICmpEQ(a.hi, b.hi));
+            } else if (pred == llvm::ICmpInst::ICMP_NE) {
+                result = builder.CreateOr(builder.CreateICmpNE(a.lo, b.lo), builder.CreateICmpNE(a.hi, b.hi));
+            } else {
+                // The upper halves decide, unless they are equal.
+                auto lo = builder.CreateICmp(llvm::ICmpInst::getUnsignedPredicate(pred), a.lo, b.lo);
+                auto hi = builder.CreateICmp(llvm::ICmpInst::getStrictPredicate(pred), a.hi, b.hi);
+                result = builder.CreateSelect(builder.CreateICmpEQ(a.hi, b.hi), lo, hi);
+            }
+            ins.replaceAllUsesWith(result);
+            break;
+        }
+
+        case llvm::Instruction::Select: {
+            auto& select = llvm::cast<llvm::SelectInst>(ins);
+            auto a = get(select.getTrueValue()), b = get(select.getFalseValue());
+            auto cond = select.getCondition();
+            halves[&ins] = { builder.CreateSelect(cond, a.lo, b.lo), builder.CreateSelect(cond, a.hi, b.hi) };
+            break;
+        }
+
+        case llvm::Instruction::PHI: {
+            auto& phi = llvm::cast<llvm::PHINode>(ins);
+            auto n = phi.getNumIncomingValues();
+            Halves result = { builder.CreatePHI(i32, n), builder.CreatePHI(i32, n) };
+            halves[&ins] = result;
+            // Incoming values may not be lowered yet.
+            phis.emplace_back(&phi, result);
+            break;
+        }
+
+        case llvm::Instruction::Freeze: {
+            auto a = get(ins.getOperand(0));
+            halves[&ins] = { builder.CreateFreeze(a.lo), builder.CreateFreeze(a.hi) };
+            break;
+        }
+
+        default:
+            fail(ins, "Unsupported 64-bit instruction");
+    }
+}
+
+void Legalizer::run() {
+    // Blocks are visited so that values are lowered before their uses, apart
+    // from those coming into phi nodes.
+    llvm::removeUnreachableBlocks(f);
+    llvm::ReversePostOrderTraversal<llvm::Function *> order(&f);
+    for (auto block : order) {
+        for (auto& ins : *block) {
+            if (ins.getType()->isSized() && !isWide(ins.getType())) {
+                auto size = ins.getType()->getPrimitiveSizeInBits().getFixedValue();
+                if (size > 32) {
+                    fprintf(stderr, "Strange integer size of %lu bits\n", (unsigned long) size);
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+        // Lowering inserts instructions, so collect the block's first.
+        std::vector<llvm::Instruction *> instructions;
+        for (auto& ins : *block) {
+            instructions.push_back(&ins);
+        }
+        for (auto ins : instructions) {
+            lower(*ins);
+        }
+    }
+
+    if (replaced.empty())
+        return;
+
+    for (auto& [phi, result] : phis) {
+        for (auto i = 0U; i < phi->getNumIncomingValues(); i++) {
+            auto value = get(phi->getIncomingValue(i));
+            auto block = phi->getIncomingBlock(i);
+            llvm::cast<llvm::PHINode>(result.lo)->addIncoming(value.lo, block);
+            llvm::cast<llvm::PHINode>(result.hi)->addIncoming(value.hi, block);
+        }
+    }
+
+    // Every use of a replaced value is itself replaced by now.
+    for (auto ins : replaced) {
+        if (!ins->getType()->isVoidTy()) {
+            ins->replaceAllUsesWith(llvm::PoisonValue::get(ins->getType()));
+        }
+    }
+    for (auto ins : replaced) {
+        ins->eraseFromParent();
+    }
+
+    // Drop the halves nothing ended up using, such as the upper half of a
+    // product that is shifted down and truncated.
+    for (auto changed = true; changed; ) {
+        changed = false;
+        for (auto& block : f) {
+            for (auto it = block.begin(); it != block.end(); ) {
+                auto& ins = *it++;
+                if (llvm::isInstructionTriviallyDead(&ins)) {
+                    ins.eraseFromParent();
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+void legalize64Bit(llvm::Function& f) {
+    if (f.isDeclaration())
+        return;
+    Legalizer(f).run();
+}
@@ -0,0 +1,11 @@
+#ifndef CONVERTER_LEGALIZE_H
+#define CONVERTER_LEGALIZE_H
+
+namespace llvm {
+    class Function;
+}
+
+// Rewrite 64-bit integer operations as operations on their 32-bit halves.
+void legalize64Bit(llvm::Function& f);
+
+#endif
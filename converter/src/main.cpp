@@ -1,20 +1,125 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
 #include <llvm/Bitcode/BitcodeReader.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Support/MemoryBuffer.h>
 
 #include "compiler.hpp"
+#include "options.hpp"
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] <bitcode file> <output dir>\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --report <file>          write per-function statistics\n");
+    fprintf(stderr, "  --memory-model <model>   bytes (default) or words\n");
+    fprintf(stderr, "  --image-format <format>  runs (default) or raw, for data.bin and snapshot.bin\n");
+    fprintf(stderr, "  --inline-memory <size>   write out memory helpers in functions of up to\n");
+    fprintf(stderr, "                           <size> instructions\n");
+    fprintf(stderr, "  --zone-size <bytes>      size of the zone heap (default 12 MiB), a multiple of 4\n");
+    fprintf(stderr, "  --stack-size <bytes>     size of the stack (default 1 MiB), a multiple of 4\n");
+    fprintf(stderr, "  --opt-level <level>      optimize the program from 0 (default) to 3, where\n");
+    fprintf(stderr, "                           2 inlines small leaf functions and 3 unswitches loops\n");
+    fprintf(stderr, "  -j <jobs>                compile functions on <jobs> threads\n");
+    fprintf(stderr, "  --cache <dir>            reuse code for unchanged functions\n");
+    fprintf(stderr, "  --snapshot <file>        run startup with this WAD or lump file loaded and\n");
+    fprintf(stderr, "                           resume from there, can be repeated\n");
+    exit(EXIT_FAILURE);
+}
+
+// Parse a number, in decimal or in hexadecimal with 0x, that fits in 32 bits.
+static uint32_t parseNumber(const char *program, const char *text) {
+    if (!isdigit(static_cast<unsigned char>(text[0]))) usage(program);
+    errno = 0;
+    char *end;
+    auto value = strtoull(text, &end, 0);
+    if (*end != '\0' || errno != 0 || value > UINT32_MAX) usage(program);
+    return value;
+}
+
+// Parse a size of a memory region, which must be a nonzero multiple of 4.
+static uint32_t parseSize(const char *program, const char *text) {
+    auto value = parseNumber(program, text);
+    if (value == 0 || value % 4 != 0) usage(program);
+    return value;
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <bitcode file> <output dir>", argv[0]);
-        return EXIT_FAILURE;
+    Options options;
+    std::vector<const char *> positional;
+
+    for (auto i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--report") {
+            if (++i == argc) usage(argv[0]);
+            options.reportFile = argv[i];
+        } else if (arg == "--memory-model") {
+            if (++i == argc) usage(argv[0]);
+            std::string model = argv[i];
+            if (model == "bytes") {
+                options.memoryModel = MemoryModel::Bytes;
+            } else if (model == "words") {
+                options.memoryModel = MemoryModel::Words;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (arg == "--image-format") {
+            if (++i == argc) usage(argv[0]);
+            std::string format = argv[i];
+            if (format == "runs") {
+                options.imageFormat = ImageFormat::Runs;
+            } else if (format == "raw") {
+                options.imageFormat = ImageFormat::Raw;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (arg == "--inline-memory") {
+            if (++i == argc) usage(argv[0]);
+            options.inlineLimit = parseNumber(argv[0], argv[i]);
+        } else if (arg == "--zone-size") {
+            if (++i == argc) usage(argv[0]);
+            options.zoneSize = parseSize(argv[0], argv[i]);
+        } else if (arg == "--stack-size") {
+            if (++i == argc) usage(argv[0]);
+            options.stackSize = parseSize(argv[0], argv[i]);
+        } else if (arg == "--opt-level") {
+            if (++i == argc) usage(argv[0]);
+            std::string level = argv[i];
+            if (level.size() != 1 || level[0] < '0' || level[0] > '3') usage(argv[0]);
+            options.optLevel = level[0] - '0';
+        } else if (arg == "--cache") {
+            if (++i == argc) usage(argv[0]);
+            options.cacheDir = argv[i];
+        } else if (arg == "--snapshot") {
+            if (++i == argc) usage(argv[0]);
+            options.snapshotFiles.push_back(argv[i]);
+        } else if (arg.compare(0, 2, "-j") == 0) {
+            std::string jobs = arg.size() > 2 ? arg.substr(2) : (++i == argc ? "" : argv[i]);
+            if (jobs.empty() || jobs.find_first_not_of("0123456789") != std::string::npos) usage(argv[0]);
+            options.jobs = std::max(std::stoul(jobs), 1UL);
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            usage(argv[0]);
+        } else {
+            positional.push_back(argv[i]);
+        }
     }
 
-    auto tryBuf = llvm::MemoryBuffer::getFile(argv[1]);
+    if (positional.size() != 2) usage(argv[0]);
+    // Memory is indexed with signed 32-bit integers.
+    if (static_cast<uint64_t>(options.zoneSize) + options.stackSize > INT32_MAX) usage(argv[0]);
+    auto inputFile = positional[0];
+    auto outDir = positional[1];
+
+    auto tryBuf = llvm::MemoryBuffer::getFile(inputFile);
     if (auto ec = tryBuf.getError()) {
         auto msg = ec.message();
-        fprintf(stderr, "Failed to read %s: %s\n", argv[1], msg.c_str());
+        fprintf(stderr, "Failed to read %s: %s\n", inputFile, msg.c_str());
         exit(EXIT_FAILURE);
     }
     auto buf = tryBuf->get();
@@ -23,14 +128,17 @@ int main(int argc, char *argv[]) {
     auto tryModule = llvm::parseBitcodeFile(buf->getMemBufferRef(), ctx);
     if (!tryModule) {
         auto msg = llvm::toString(tryModule.takeError());
-        fprintf(stderr, "Failed to parse %s: %s\n", argv[1], msg.c_str());
+        fprintf(stderr, "Failed to parse %s: %s\n", inputFile, msg.c_str());
         exit(EXIT_FAILURE);
     }
     auto module = tryModule->get();
 
-    Compiler compiler(module, argv[2]);
+    Compiler compiler(module, outDir, options);
     compiler.compile();
     compiler.write();
+    if (options.reportFile != nullptr) {
+        compiler.writeReport(options.reportFile);
+    }
 
     return EXIT_SUCCESS;
 }
@@ -1,4 +1,8 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
 #include <cstdlib>
+#include <llvm/ADT/MapVector.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/Support/TypeSize.h>
 #include <ostream>
@@ -7,10 +11,11 @@
 #include <llvm/IR/DataLayout.h>
 #include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/Operator.h>
 
 #include "memory.hpp"
 
-std::string FuncPtrType::mapName() const {
+std::string FuncPtrType::dispatchName() const {
     return std::string("fp") + (hasReturnValue ? "i" : "v") + std::to_string(numParams) + (isVarArg ? "v" : "");
 }
 
@@ -68,14 +73,15 @@ void GlobalMemory::writeConstant(uint32_t offset, const llvm::Constant *c, const
         for (auto i = 0U; i < size; i++) {
             writeByte(offset++, 0);
         }
-    } else if (auto v = llvm::dyn_cast<llvm::ConstantExpr>(c)) {
-        auto ins = llvm::cast<llvm::GetElementPtrInst>(v->getAsInstruction());
+    } else if (auto v = llvm::dyn_cast<llvm::GEPOperator>(c)) {
         llvm::APInt elementOffset(32, 0);
-        assert(ins->accumulateConstantOffset(layout, elementOffset) && "Global GEP is not constant");
+        if (!v->accumulateConstantOffset(layout, elementOffset)) {
+            fprintf(stderr, "Global GEP is not constant\n");
+            exit(EXIT_FAILURE);
+        }
 
-        auto ptrName = ins->getOperand(0)->getName().str();
+        auto ptrName = v->getPointerOperand()->getName().str();
         auto ptrOffset = getAddress(ptrName);
-        ins->deleteValue();
 
         auto finalOffset = ptrOffset + elementOffset.getLimitedValue();
         writePtr(offset, finalOffset);
@@ -91,8 +97,8 @@ void GlobalMemory::writeConstant(uint32_t offset, const llvm::Constant *c, const
 void Section::registerGlobal(const llvm::GlobalVariable& global, const llvm::DataLayout &layout) {
     auto t = global.getInitializer()->getType();
 
-    // Align variable.
-    auto alignment = layout.getPrefTypeAlign(t).value();
+    // Align variable. Code may rely on any alignment the global asks for.
+    auto alignment = std::max(layout.getPrefTypeAlign(t), global.getAlign().valueOrOne()).value();
     address = llvm::alignTo(address, alignment);
     if (alignment > maxAlign)
         maxAlign = alignment;
@@ -129,6 +135,10 @@ bool FuncPtrType::operator<(const FuncPtrType &other) const {
     return false;
 }
 
+bool FuncPtrType::operator==(const FuncPtrType &other) const {
+    return hasReturnValue == other.hasReturnValue && isVarArg == other.isVarArg && numParams == other.numParams;
+}
+
 void GlobalMemory::registerGlobal(const llvm::GlobalVariable& global, const llvm::DataLayout &layout) {
     Section *section;
     if (global.getInitializer()->isNullValue()) {
@@ -151,6 +161,171 @@ void GlobalMemory::initializeGlobal(const llvm::GlobalVariable& global, const ll
     writeConstant(offset, init, layout);
 }
 
+bool GlobalMemory::promoteGlobal(const llvm::GlobalVariable& global, const llvm::DataLayout& layout) {
+    if (!global.hasInitializer())
+        return false;
+
+    auto t = global.getValueType();
+    if (!(t->isIntegerTy() || t->isPointerTy()) || layout.getTypeStoreSize(t) > 4)
+        return false;
+
+    // The global may only be loaded and stored as a whole. Anything else could
+    // let its address escape.
+    for (const auto user : global.users()) {
+        if (auto ins = llvm::dyn_cast<llvm::LoadInst>(user)) {
+            if (ins->isVolatile() || ins->getType() != t)
+                return false;
+        } else if (auto ins = llvm::dyn_cast<llvm::StoreInst>(user)) {
+            if (ins->isVolatile() || ins->getValueOperand() == &global || ins->getValueOperand()->getType() != t)
+                return false;
+        } else {
+            return false;
+        }
+    }
+
+    auto name = global.getName().str();
+    promoted[name] = &global;
+    fields[name] = uniqueField("global_", name);
+    return true;
+}
+
+std::string GlobalMemory::uniqueField(const std::string& prefix, const std::string& name) const {
+    auto field = prefix + name;
+    std::replace_if(field.begin(), field.end(), [](char c) { return !isalnum(c); }, '_');
+    auto taken = [&](const std::string& f) {
+        return std::any_of(fields.begin(), fields.end(), [&](const auto& other) { return other.second == f; })
+            || std::any_of(tables.begin(), tables.end(), [&](const auto& other) { return other.second.field == f; });
+    };
+    while (taken(field)) {
+        field += "_";
+    }
+    return field;
+}
+
+// Append the integers of a constant array, in memory order. Returns false if
+// any of them is not known until memory is laid out, such as an address.
+static bool flattenConstant(const llvm::Constant *c, std::vector<uint32_t>& out) {
+    if (auto v = llvm::dyn_cast<llvm::ConstantInt>(c)) {
+        out.push_back(v->getZExtValue());
+    } else if (llvm::isa<llvm::UndefValue>(c)) {
+        out.push_back(0);
+    } else if (c->getType()->isIntegerTy()) {
+        return false;
+    } else {
+        auto count = llvm::cast<llvm::ArrayType>(c->getType())->getNumElements();
+        for (auto i = 0U; i < count; i++) {
+            if (!flattenConstant(c->getAggregateElement(i), out))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool GlobalMemory::tabulateGlobal(const llvm::GlobalVariable& global, const llvm::DataLayout& layout) {
+    if (!global.isConstant() || !global.hasInitializer() || !global.getValueType()->isArrayTy())
+        return false;
+
+    auto t = global.getValueType();
+    while (t->isArrayTy()) {
+        t = t->getArrayElementType();
+    }
+    if (!t->isIntegerTy())
+        return false;
+    auto bytes = layout.getTypeStoreSize(t).getFixedValue();
+    if (bytes > 4 || t->getIntegerBitWidth() != bytes * 8)
+        return false;
+
+    // Every use must be a load of one element, through offsets that stay on
+    // element boundaries, so that its address never escapes.
+    std::vector<const llvm::Value *> work = { &global };
+    while (!work.empty()) {
+        auto ptr = work.back();
+        work.pop_back();
+        for (const auto user : ptr->users()) {
+            if (auto load = llvm::dyn_cast<llvm::LoadInst>(user)) {
+                if (load->isVolatile() || load->getType() != t)
+                    return false;
+            } else if (auto gep = llvm::dyn_cast<llvm::GEPOperator>(user)) {
+                if (gep->getPointerOperand() != ptr)
+                    return false;
+
+                llvm::APInt constantOffset(32, 0);
+                llvm::MapVector<llvm::Value *, llvm::APInt> offsets;
+                if (!gep->collectOffset(layout, 32, offsets, constantOffset))
+                    return false;
+                if (constantOffset.isNegative() || constantOffset.getSExtValue() % bytes != 0)
+                    return false;
+                for (const auto& [_, scale] : offsets) {
+                    if (scale.getSExtValue() < 1 || scale.getSExtValue() % bytes != 0)
+                        return false;
+                }
+                work.push_back(gep);
+            } else {
+                return false;
+            }
+        }
+    }
+
+    ConstantTable table;
+    if (!flattenConstant(global.getInitializer(), table.values))
+        return false;
+
+    auto name = global.getName().str();
+    table.global = &global;
+    table.field = uniqueField("table_", name);
+    table.elementBytes = bytes;
+    tables[name] = std::move(table);
+    return true;
+}
+
+const ConstantTable *GlobalMemory::getTable(const std::string& name) const {
+    auto it = tables.find(name);
+    if (it == tables.end()) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+const std::map<std::string, ConstantTable>& GlobalMemory::constantTables() const {
+    return tables;
+}
+
+const std::string *GlobalMemory::getField(const std::string& name) const {
+    auto it = fields.find(name);
+    if (it == fields.end()) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+uint32_t GlobalMemory::constantValue(const llvm::Constant *c, const llvm::DataLayout& layout) const {
+    if (auto v = llvm::dyn_cast<llvm::ConstantInt>(c)) {
+        return v->getValue().getLimitedValue();
+    } else if (auto v = llvm::dyn_cast<llvm::Function>(c)) {
+        return getFuncIndex(v);
+    } else if (auto v = llvm::dyn_cast<llvm::GlobalVariable>(c)) {
+        return getAddress(v->getName().str());
+    } else if (c->isNullValue() || llvm::isa<llvm::UndefValue>(c)) {
+        return 0;
+    } else if (auto v = llvm::dyn_cast<llvm::GEPOperator>(c)) {
+        llvm::APInt elementOffset(32, 0);
+        if (!v->accumulateConstantOffset(layout, elementOffset)) {
+            fprintf(stderr, "Global GEP is not constant\n");
+            exit(EXIT_FAILURE);
+        }
+
+        auto ptrOffset = getAddress(v->getPointerOperand()->getName().str());
+
+        return ptrOffset + elementOffset.getLimitedValue();
+    }
+
+    llvm::errs() << "Constant type unsupported: ";
+    c->print(llvm::errs());
+    llvm::errs() << "\n";
+
+    exit(EXIT_FAILURE);
+}
+
 bool Section::getAddress(const std::string& name, uint32_t& out) const {
     auto it = variables.find(name);
     if (it == variables.end()) {
@@ -203,45 +378,244 @@ void GlobalMemory::allocateMemory() {
     memory = std::make_unique<uint8_t[]>(size);
 }
 
-void GlobalMemory::saveMemory(std::ostream& out) {
-    out.write(reinterpret_cast<const char *>(memory.get()), size);
+// Kinds of records in an image of runs. These must match DoomInDoom.zs.
+enum ImageRun : uint8_t {
+    Literal,
+    Zeros,
+    Repeat,
+};
+
+// Shorter runs cost more as a record of their own than as part of a literal.
+static constexpr size_t MIN_ZERO_RUN = 2;
+static constexpr size_t MIN_REPEAT_RUN = 4;
+
+static void writeWord(std::ostream& out, uint32_t word) {
+    for (auto i = 0U; i < 32; i += 8) {
+        out.put(char(word >> i));
+    }
 }
 
-void GlobalMemory::writeFunctionMaps(std::ostream& out) {
-    for (const auto& [fp, _] : functionPtrMaps) {
-        out << "Map<uint,function<play ";
-        if (fp.hasReturnValue) {
-            out << "uint";
+void writeImage(std::ostream& out, const uint8_t *data, size_t size, ImageFormat format, const char *name) {
+    out.put(char(format));
+    if (format == ImageFormat::Raw) {
+        out.write(reinterpret_cast<const char *>(data), size);
+        return;
+    }
+
+    std::vector<uint32_t> words((size + 3) / 4);
+    for (size_t i = 0; i < size; i++) {
+        words[i / 4] |= uint32_t(data[i]) << (i % 4 * 8);
+    }
+    // Memory starts out zeroed, so trailing zeros need nothing.
+    while (!words.empty() && words.back() == 0) {
+        words.pop_back();
+    }
+
+    size_t records = 0, stores = 0;
+    auto writeLiteral = [&](size_t begin, size_t end) {
+        if (begin == end)
+            return;
+        out.put(char(ImageRun::Literal));
+        writeWord(out, end - begin);
+        for (auto i = begin; i < end; i++) {
+            writeWord(out, words[i]);
+        }
+        records++;
+        stores += end - begin;
+    };
+
+    size_t literal = 0;
+    for (size_t i = 0; i < words.size(); ) {
+        size_t length = 1;
+        while (i + length < words.size() && words[i + length] == words[i]) {
+            length++;
+        }
+
+        if (length < (words[i] == 0 ? MIN_ZERO_RUN : MIN_REPEAT_RUN)) {
+            i += length;
+            continue;
+        }
+
+        writeLiteral(literal, i);
+        if (words[i] == 0) {
+            out.put(char(ImageRun::Zeros));
+            writeWord(out, length);
         } else {
-            out << "void";
+            out.put(char(ImageRun::Repeat));
+            writeWord(out, length);
+            writeWord(out, words[i]);
+            stores += length;
         }
-        out << "(DoomInDoom";
-        for (auto i = 0U; i < fp.numParams; i++) {
-            out << ",uint";
+        records++;
+        i += length;
+        literal = i;
+    }
+    writeLiteral(literal, words.size());
+
+    printf("Wrote %s as %zu runs, with %zu word stores instead of %zu byte stores\n", name, records, stores, size);
+}
+
+void GlobalMemory::saveMemory(std::ostream& out, ImageFormat format) {
+    writeImage(out, memory.get(), size, format, "data.bin");
+}
+
+void GlobalMemory::copyMemory(uint8_t *out) const {
+    std::copy(memory.get(), memory.get() + size, out + MEMORY_INITIAL_OFFSET);
+}
+
+uint32_t GlobalMemory::end() const {
+    return MEMORY_INITIAL_OFFSET + data.size() + bss.size();
+}
+
+// Keep both regions aligned for anything the stack or the zone hands out.
+static constexpr uint32_t REGION_ALIGN = 16;
+
+void GlobalMemory::reserve(uint32_t zoneBytes, uint32_t stackBytes) {
+    uint64_t start = llvm::alignTo(end(), REGION_ALIGN);
+    uint64_t total = llvm::alignTo(start + zoneBytes + stackBytes, REGION_ALIGN);
+    if (total > INT32_MAX) {
+        fprintf(stderr, "Memory of %llu bytes is too large\n", (unsigned long long) total);
+        exit(EXIT_FAILURE);
+    }
+
+    zoneStart = start;
+    zoneSize = zoneBytes;
+    totalSize = total;
+}
+
+uint32_t GlobalMemory::zoneBase() const {
+    return zoneStart;
+}
+
+uint32_t GlobalMemory::zoneEnd() const {
+    return zoneStart + zoneSize;
+}
+
+uint32_t GlobalMemory::memorySize() const {
+    return totalSize;
+}
+
+void GlobalMemory::writeLayout(std::ostream& out) const {
+    out << "const MEMORY_SIZE = " << totalSize << ";\n";
+    out << "const ZONE_BASE = " << zoneStart << ";\n";
+    out << "const ZONE_SIZE = " << zoneSize << ";\n";
+}
+
+const std::map<std::string, const llvm::GlobalVariable *>& GlobalMemory::promotedGlobals() const {
+    return promoted;
+}
+
+// Switches are a chain of comparisons, so split the range in halves until
+// only a few cases are left for each switch.
+static constexpr size_t DISPATCH_SWITCH_CASES = 8;
+
+static void writeDispatchRange(std::ostream& out, const FuncPtrType& fp, const std::vector<std::pair<uint32_t, std::string>>& targets, size_t begin, size_t end) {
+    if (end - begin > DISPATCH_SWITCH_CASES) {
+        auto mid = begin + (end - begin) / 2;
+        out << "if(idx<" << targets[mid].first << "U){\n";
+        writeDispatchRange(out, fp, targets, begin, mid);
+        out << "}else{\n";
+        writeDispatchRange(out, fp, targets, mid, end);
+        out << "}\n";
+        return;
+    }
+
+    out << "switch(idx){\n";
+    for (auto i = begin; i < end; i++) {
+        out << "case " << targets[i].first << ":";
+        if (fp.hasReturnValue) {
+            out << "return ";
+        }
+        out << "func_" << targets[i].second << "(";
+        for (auto j = 0U; j < fp.numParams; j++) {
+            if (j) out << ",";
+            out << "a" << j;
         }
         if (fp.isVarArg) {
-            out << ",VAList";
+            if (fp.numParams) out << ",";
+            out << "v";
+        }
+        out << ");\n";
+        if (!fp.hasReturnValue) {
+            out << "return;\n";
         }
-        out << ")> >";
-        out << fp.mapName();
-        out << ";\n";
     }
+    out << "}\n";
+}
 
-    out << "void loadFuncPtrs(){\n";
+void GlobalMemory::writeDispatchers(std::ostream& out) {
     for (const auto& [fp, m] : functionPtrMaps) {
-        auto name = fp.mapName();
-        for (const auto& [c, idx] : m) {
-            out << name << ".Insert(" << idx << ",func_" << c << ");\n";
+        std::vector<std::pair<uint32_t, std::string>> targets;
+        for (const auto& [name, idx] : m) {
+            targets.emplace_back(idx, name);
+        }
+        std::sort(targets.begin(), targets.end());
+
+        out << (fp.hasReturnValue ? "uint " : "void ") << fp.dispatchName() << "(uint idx";
+        for (auto i = 0U; i < fp.numParams; i++) {
+            out << ",uint a" << i;
+        }
+        if (fp.isVarArg) {
+            out << ",uint v";
+        }
+        out << "){\n";
+
+        writeDispatchRange(out, fp, targets, 0, targets.size());
+
+        out << "BadFunction(idx);\n";
+        if (fp.hasReturnValue) {
+            out << "return 0U;\n";
+        }
+        out << "}\n";
+    }
+}
+
+void GlobalMemory::writeFields(std::ostream& out, const llvm::DataLayout& layout) {
+    for (const auto& [_, field] : fields) {
+        out << "uint " << field << ";\n";
+    }
+
+    out << "void loadFields(){\n";
+    for (const auto& [name, global] : promoted) {
+        auto value = constantValue(global->getInitializer(), layout);
+        if (value != 0) {
+            out << fields.at(name) << "=" << value << "U;\n";
         }
     }
     out << "}\n";
 }
 
-std::string GlobalMemory::getFuncPtr(const llvm::FunctionType *f, std::string idx) const {
+// Values per line of a table, to keep the lines readable.
+static constexpr size_t TABLE_LINE_VALUES = 16;
+
+void GlobalMemory::writeTables(std::ostream& out) {
+    for (const auto& [_, table] : tables) {
+        // The values are written as ints with the same bits, and loads read
+        // them back as uint.
+        out << "static const int " << table.field << "[]={";
+        for (auto i = 0U; i < table.values.size(); i++) {
+            if (i % TABLE_LINE_VALUES == 0) {
+                out << "\n";
+            }
+            if (table.values[i] == 0x80000000U) {
+                // The literal 2147483648 does not fit in an int.
+                out << "-2147483647-1,";
+            } else {
+                out << int32_t(table.values[i]) << ",";
+            }
+        }
+        out << "\n};\n";
+    }
+}
+
+std::string GlobalMemory::getDispatcher(const llvm::FunctionType *f) const {
     FuncPtrType fp(f);
-    auto& list = functionPtrMaps.at(fp);
+    if (functionPtrMaps.find(fp) == functionPtrMaps.end()) {
+        fprintf(stderr, "No functions of the called type have their address taken\n");
+        exit(EXIT_FAILURE);
+    }
 
-    return fp.mapName() + ".Get(" + idx + ").Call";
+    return fp.dispatchName();
 }
 
 uint32_t GlobalMemory::getFuncIndex(const llvm::Function *f) const {
@@ -3,6 +3,10 @@
 
 #include <map>
 #include <memory>
+#include <string>
+#include <vector>
+
+#include "options.hpp"
 
 namespace llvm {
     class Constant;
@@ -14,6 +18,19 @@ namespace llvm {
 
 struct GlobalMemory;
 
+// A constant array kept in a ZScript array instead of memory. Pointers into
+// it are element indices rather than addresses.
+struct ConstantTable {
+    const llvm::GlobalVariable *global;
+    std::string field;
+    // Size of each element, which are all integers of the same width.
+    uint32_t elementBytes;
+    std::vector<uint32_t> values;
+};
+
+// Write memory loaded at MIN_VALID_MEMORY as an image for DoomInDoom.LoadImage.
+void writeImage(std::ostream& out, const uint8_t *data, size_t size, ImageFormat format, const char *name);
+
 class Section {
     std::map<std::string, uint32_t> variables;
     uint32_t address = 0;
@@ -38,9 +55,10 @@ struct FuncPtrType {
 
     FuncPtrType(const llvm::FunctionType *f);
 
-    std::string mapName() const;
+    std::string dispatchName() const;
 
     bool operator<(const FuncPtrType &other) const;
+    bool operator==(const FuncPtrType &other) const;
 };
 
 class GlobalMemory {
@@ -50,10 +68,27 @@ class GlobalMemory {
     std::unique_ptr<uint8_t[]> memory = nullptr;
     uint32_t size = 0;
 
+    // Regions after the globals, ending at the top of memory.
+    uint32_t zoneStart = 0;
+    uint32_t zoneSize = 0;
+    uint32_t totalSize = 0;
+
     std::map<FuncPtrType, std::map<std::string, uint32_t>> functionPtrMaps;
     uint32_t funcPtrIndex = 1;
 
+    // Globals kept in class fields instead of memory, by name.
+    std::map<std::string, const llvm::GlobalVariable *> promoted;
+    std::map<std::string, std::string> fields;
+
+    // Constant arrays kept in ZScript arrays, by name.
+    std::map<std::string, ConstantTable> tables;
+
+    std::string uniqueField(const std::string& prefix, const std::string& name) const;
+
 public:
+    // Get the value of a constant stored in memory or a field.
+    uint32_t constantValue(const llvm::Constant *c, const llvm::DataLayout& layout) const;
+
     // Write a byte to memory.
     void writeByte(uint32_t addr, uint8_t value);
 
@@ -72,6 +107,23 @@ public:
     // Register a function.
     void registerFunction(const llvm::Function *f);
 
+    // Move a global variable into a field if its address is never needed.
+    // Returns true if it was promoted, in which case it takes no memory.
+    bool promoteGlobal(const llvm::GlobalVariable& global, const llvm::DataLayout& layout);
+
+    // Get the field holding a promoted global, or nullptr if it lives in memory.
+    const std::string *getField(const std::string& name) const;
+
+    // Move a constant array into a ZScript array if it is only ever indexed
+    // and read. Returns true if it was, in which case it takes no memory.
+    bool tabulateGlobal(const llvm::GlobalVariable& global, const llvm::DataLayout& layout);
+
+    // Get the table holding a constant array, or nullptr if it lives in memory.
+    const ConstantTable *getTable(const std::string& name) const;
+
+    // Get the constant arrays kept in ZScript arrays, by name.
+    const std::map<std::string, ConstantTable>& constantTables() const;
+
     // Register a global variable.
     void registerGlobal(const llvm::GlobalVariable& global, const llvm::DataLayout& layout);
 
@@ -84,11 +136,42 @@ public:
     void allocateMemory();
 
     // Write memory to a file.
-    void saveMemory(std::ostream& out);
+    void saveMemory(std::ostream& out, ImageFormat format);
+
+    // Copy the initialized data to where it is loaded, in memory starting at
+    // address zero.
+    void copyMemory(uint8_t *out) const;
+
+    // Get the first address past all globals.
+    uint32_t end() const;
+
+    // Place the zone heap after the globals, then the stack, which grows down
+    // from the top of memory.
+    void reserve(uint32_t zoneBytes, uint32_t stackBytes);
+
+    // Get the start and first address past the zone heap.
+    uint32_t zoneBase() const;
+    uint32_t zoneEnd() const;
+
+    // Get the size of memory, which is where the stack starts.
+    uint32_t memorySize() const;
+
+    // Write the constants describing the memory layout.
+    void writeLayout(std::ostream& out) const;
+
+    // Get the globals kept in fields, by name.
+    const std::map<std::string, const llvm::GlobalVariable *>& promotedGlobals() const;
+
+    // Write the functions calling function pointers of each signature.
+    void writeDispatchers(std::ostream& out);
+
+    void writeFields(std::ostream& out, const llvm::DataLayout& layout);
 
-    void writeFunctionMaps(std::ostream& out);
+    // Write the arrays holding constant tables.
+    void writeTables(std::ostream& out);
 
-    std::string getFuncPtr(const llvm::FunctionType *f, std::string idx) const;
+    // Get the function calling function pointers of the given type.
+    std::string getDispatcher(const llvm::FunctionType *f) const;
 
     uint32_t getFuncIndex(const llvm::Function *f) const;
 };
@@ -0,0 +1,152 @@
+#include <cstdio>
+
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/InstrTypes.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Transforms/IPO/AlwaysInliner.h>
+#include <llvm/Transforms/IPO/GlobalDCE.h>
+#include <llvm/Transforms/IPO/GlobalOpt.h>
+#include <llvm/Transforms/IPO/Internalize.h>
+#include <llvm/Transforms/IPO/SCCP.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar/EarlyCSE.h>
+#include <llvm/Transforms/Scalar/JumpThreading.h>
+#include <llvm/Transforms/Scalar/LoopPassManager.h>
+#include <llvm/Transforms/Scalar/SimpleLoopUnswitch.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
+
+#include "optimize.hpp"
+
+// Leaf functions of up to this many instructions are inlined into every
+// caller, by optimization level.
+static constexpr uint32_t INLINE_LIMITS[] = { 0, 0, 16, 48 };
+
+// Whether a function makes no calls once compiled. Memory intrinsics become
+// calls to memset, memcpy and memmove.
+static bool isLeaf(const llvm::Function& func) {
+    for (const auto& block : func) {
+        for (const auto& ins : block) {
+            auto call = llvm::dyn_cast<llvm::CallBase>(&ins);
+            if (call == nullptr)
+                continue;
+            auto callee = call->getCalledFunction();
+            if (callee == nullptr || !callee->isIntrinsic() || llvm::isa<llvm::MemIntrinsic>(call))
+                return false;
+        }
+    }
+    return true;
+}
+
+// A call costs the VM far more than the arithmetic in a small function, so
+// small leaves are inlined wherever they are called. Returns how many
+// functions were marked, and counts their calls.
+static uint32_t markLeaves(llvm::Module& m, uint32_t limit, uint32_t& calls) {
+    uint32_t count = 0;
+    for (auto& func : m) {
+        if (func.isDeclaration() || func.isVarArg() || func.hasFnAttribute(llvm::Attribute::NoInline))
+            continue;
+        if (func.getInstructionCount() > limit || !isLeaf(func))
+            continue;
+
+        uint32_t sites = 0;
+        for (const auto user : func.users()) {
+            auto call = llvm::dyn_cast<llvm::CallBase>(user);
+            if (call != nullptr && call->getCalledOperand() == &func) {
+                sites++;
+            }
+        }
+        if (sites == 0)
+            continue;
+
+        func.addFnAttr(llvm::Attribute::AlwaysInline);
+        count++;
+        calls += sites;
+    }
+    return count;
+}
+
+static uint32_t instructionCount(const llvm::Module& m) {
+    uint32_t count = 0;
+    for (const auto& func : m) {
+        count += func.getInstructionCount();
+    }
+    return count;
+}
+
+void optimizeModule(llvm::Module& m, uint32_t level, const std::set<std::string>& entryPoints) {
+    if (level == 0)
+        return;
+
+    auto before = instructionCount(m);
+
+    // The sources are built for size, but the VM pays for every instruction
+    // run rather than for code size, so let passes duplicate code.
+    if (level >= 2) {
+        for (auto& func : m) {
+            func.removeFnAttr(llvm::Attribute::OptimizeForSize);
+            func.removeFnAttr(llvm::Attribute::MinSize);
+        }
+    }
+
+    uint32_t leaves = 0, calls = 0;
+    if (INLINE_LIMITS[level] > 0) {
+        leaves = markLeaves(m, INLINE_LIMITS[level], calls);
+    }
+
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+
+    // The program brings its own C library, so passes must not treat
+    // functions specially by name or introduce calls to them.
+    llvm::TargetLibraryInfoImpl libraryInfo(llvm::Triple(m.getTargetTriple()));
+    libraryInfo.disableAllFunctions();
+    fam.registerPass([&] { return llvm::TargetLibraryAnalysis(libraryInfo); });
+
+    llvm::PassBuilder pb;
+    pb.registerModuleAnalyses(mam);
+    pb.registerCGSCCAnalyses(cgam);
+    pb.registerFunctionAnalyses(fam);
+    pb.registerLoopAnalyses(lam);
+    pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+    llvm::ModulePassManager mpm;
+    if (!entryPoints.empty()) {
+        mpm.addPass(llvm::InternalizePass([&](const llvm::GlobalValue& value) {
+            return entryPoints.count(value.getName().str()) != 0;
+        }));
+    }
+    // Function specialization would add clones whose names are not valid in
+    // ZScript.
+    mpm.addPass(llvm::IPSCCPPass(llvm::IPSCCPOptions(false)));
+    mpm.addPass(llvm::GlobalOptPass());
+    if (leaves > 0) {
+        mpm.addPass(llvm::AlwaysInlinerPass(false));
+    }
+
+    llvm::FunctionPassManager fpm;
+    // Every load and store becomes a call to a memory helper, so drop
+    // repeated ones.
+    fpm.addPass(llvm::EarlyCSEPass(true));
+    fpm.addPass(llvm::InstCombinePass());
+    fpm.addPass(llvm::SimplifyCFGPass());
+    if (level >= 2) {
+        fpm.addPass(llvm::JumpThreadingPass());
+        // Only level 3 copies whole loops to take branches out of them.
+        fpm.addPass(llvm::createFunctionToLoopPassAdaptor(llvm::SimpleLoopUnswitchPass(level >= 3), true));
+        fpm.addPass(llvm::InstCombinePass());
+        fpm.addPass(llvm::SimplifyCFGPass());
+    }
+    mpm.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(fpm)));
+    mpm.addPass(llvm::GlobalOptPass());
+    mpm.addPass(llvm::GlobalDCEPass());
+
+    mpm.run(m, mam);
+
+    printf("Optimized at level %u from %u to %u instructions, inlining %u calls to %u leaf functions\n",
+        level, before, instructionCount(m), calls, leaves);
+}
@@ -0,0 +1,17 @@
+#ifndef CONVERTER_OPTIMIZE_H
+#define CONVERTER_OPTIMIZE_H
+
+#include <cstdint>
+#include <set>
+#include <string>
+
+namespace llvm {
+    class Module;
+}
+
+// Run LLVM passes over the linked program, favoring fewer calls and memory
+// accesses over smaller code. If any functions are named in entryPoints,
+// everything else is treated as private to the program.
+void optimizeModule(llvm::Module& m, uint32_t level, const std::set<std::string>& entryPoints);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef CONVERTER_OPTIONS_H
+#define CONVERTER_OPTIONS_H
+
+#include <cstdint>
+#include <vector>
+
+enum class MemoryModel {
+    // Memory is an array of bytes.
+    Bytes,
+    // Memory is an array of words, and aligned words are accessed directly.
+    Words,
+};
+
+enum class ImageFormat {
+    // Every byte of the image.
+    Raw,
+    // Runs of literal, zero and repeated words.
+    Runs,
+};
+
+struct Options {
+    // Where to write per-function statistics, if anywhere.
+    const char *reportFile = nullptr;
+
+    MemoryModel memoryModel = MemoryModel::Bytes;
+
+    // How data.bin and snapshot.bin hold memory.
+    ImageFormat imageFormat = ImageFormat::Runs;
+
+    // Functions with at most this many instructions have their memory helpers
+    // written out in place. Zero disables it.
+    uint32_t inlineLimit = 0;
+
+    // How hard to optimize the linked program with LLVM passes, from 0 for
+    // not at all to 3.
+    uint32_t optLevel = 0;
+
+    // How many threads compile functions.
+    uint32_t jobs = 1;
+
+    // Directory holding generated code from earlier runs, if any.
+    const char *cacheDir = nullptr;
+
+    // Bytes for the zone heap and for the stack, placed after the globals.
+    uint32_t zoneSize = 0xc00000;
+    uint32_t stackSize = 0x100000;
+
+    // WAD and lump files to take a startup snapshot with, in load order.
+    std::vector<const char *> snapshotFiles;
+};
+
+#endif
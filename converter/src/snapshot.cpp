@@ -0,0 +1,1117 @@
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <ostream>
+#include <set>
+
+#include <llvm/ADT/MapVector.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Operator.h>
+
+#include "memory.hpp"
+#include "snapshot.hpp"
+
+// This must match DoomInDoom.zs.
+static constexpr uint32_t MIN_VALID_MEMORY = 1024;
+
+// The size of the buffer I_Error formats its message into.
+static constexpr uint32_t ERROR_MESSAGE_BUF_SIZE = 512;
+
+[[noreturn]] static void fail(const std::string& message) {
+    fprintf(stderr, "Failed to take snapshot: %s\n", message.c_str());
+    exit(EXIT_FAILURE);
+}
+
+static uint32_t truncate(uint32_t value, uint32_t bits) {
+    return bits >= 32 ? value : value & ((1U << bits) - 1);
+}
+
+static int32_t signExtend(uint32_t value, uint32_t bits) {
+    return bits >= 32 ? int32_t(value) : int32_t(value << (32 - bits)) >> (32 - bits);
+}
+
+struct Lump {
+    std::string name;
+    int ns;
+    size_t file;
+    uint32_t offset;
+    uint32_t size;
+};
+
+// The markers around each namespace GZDoom gives lumps. Sprites and flats
+// are numbered as w_wad.zs sees them. Either start marker of a namespace
+// may be closed by either of its end markers.
+struct NamespaceMarkers {
+    int ns;
+    const char *starts[2];
+    const char *ends[2];
+};
+
+static const NamespaceMarkers NAMESPACES[] = {
+    { 1, { "S_START", "SS_START" }, { "S_END", "SS_END" } },
+    { 2, { "F_START", "FF_START" }, { "F_END", "FF_END" } },
+    // Namespaces W_Load ignores.
+    { 3, { "C_START", nullptr }, { "C_END", nullptr } },
+    { 4, { "TX_START", nullptr }, { "TX_END", nullptr } },
+    { 5, { "HI_START", nullptr }, { "HI_END", nullptr } },
+    { 6, { "V_START", nullptr }, { "V_END", nullptr } },
+    { 7, { "A_START", nullptr }, { "A_END", nullptr } },
+};
+
+static bool isMarker(const std::string& name, const char *const (&markers)[2]) {
+    for (const auto marker : markers) {
+        if (marker != nullptr && name == marker)
+            return true;
+    }
+    return false;
+}
+
+// The lumps GZDoom loads from the given files, listed the way w_wad.zs does.
+class LumpDirectory {
+    std::vector<std::string> files;
+    std::vector<Lump> all;
+
+    int checkNumForName(const std::string& name) const;
+
+public:
+    // Indices into all lumps, in the order W_Load lists them.
+    std::vector<int> lumps;
+
+    void add(const char *fileName);
+    void build();
+    uint32_t fingerprint(const std::set<uint32_t>& sized) const;
+
+    const Lump& get(uint32_t lump) const;
+    const char *data(const Lump& lump) const;
+};
+
+void LumpDirectory::add(const char *fileName) {
+    std::ifstream file(fileName, std::ios::binary);
+    if (file.fail()) {
+        fail(std::string("cannot read ") + fileName);
+    }
+    files.emplace_back(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    const auto& content = files.back();
+    auto index = files.size() - 1;
+
+    auto read32 = [&](size_t at) {
+        if (at + 4 > content.size()) {
+            fail(std::string("truncated WAD ") + fileName);
+        }
+        auto p = reinterpret_cast<const uint8_t *>(content.data() + at);
+        return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+    };
+
+    if (content.compare(0, 4, "IWAD") != 0 && content.compare(0, 4, "PWAD") != 0) {
+        // A lump on its own. Files with an extension have a full name that
+        // differs from the lump name, so W_Load skips them.
+        auto name = std::filesystem::path(fileName).filename().string();
+        if (name.size() > 8 || name.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != std::string::npos)
+            return;
+        all.push_back({ name, 0, index, 0, uint32_t(content.size()) });
+        return;
+    }
+
+    auto count = read32(4);
+    auto directory = read32(8);
+    // The namespace being read, if any. Markers inside it that do not end it,
+    // such as F1_START in flats, are lumps of the namespace.
+    const NamespaceMarkers *open = nullptr;
+    for (auto i = 0U; i < count; i++) {
+        auto entry = directory + i * 16;
+        auto offset = read32(entry);
+        auto size = read32(entry + 4);
+        if (size_t(offset) + size > content.size()) {
+            fail(std::string("truncated WAD ") + fileName);
+        }
+
+        std::string name(content.data() + entry + 8, strnlen(content.data() + entry + 8, 8));
+        for (auto& c : name) {
+            c = toupper(c);
+        }
+
+        // The markers of a namespace stay in the global namespace.
+        all.push_back({ name, 0, index, offset, size });
+        if (open == nullptr) {
+            for (const auto& markers : NAMESPACES) {
+                if (isMarker(name, markers.starts)) {
+                    open = &markers;
+                }
+            }
+        } else if (isMarker(name, open->ends)) {
+            open = nullptr;
+        } else {
+            all.back().ns = open->ns;
+        }
+    }
+}
+
+int LumpDirectory::checkNumForName(const std::string& name) const {
+    for (auto i = int(all.size()) - 1; i >= 0; i--) {
+        if (all[i].ns == 0 && all[i].name == name) {
+            return i;
+        }
+    }
+    fail("no " + name + " lump");
+}
+
+void LumpDirectory::build() {
+    lumps.clear();
+
+    std::map<std::string, size_t> spritesSeen;
+    std::vector<int> spriteLumps;
+    std::map<std::string, size_t> flatsSeen;
+    std::vector<int> flatLumps;
+
+    for (auto i = 0; i < int(all.size()); i++) {
+        const auto& name = all[i].name;
+        if (name == "S_START" || name == "S_END" || name == "F_START" || name == "F_END")
+            continue;
+        switch (all[i].ns) {
+            case 0:
+                lumps.push_back(i);
+                break;
+            case 1:
+                if (spritesSeen.count(name) == 0) {
+                    spritesSeen[name] = spriteLumps.size();
+                    spriteLumps.push_back(i);
+                } else {
+                    spriteLumps[spritesSeen[name]] = i;
+                }
+                break;
+            case 2:
+                if (flatsSeen.count(name) == 0) {
+                    flatsSeen[name] = flatLumps.size();
+                    flatLumps.push_back(i);
+                } else {
+                    flatLumps[flatsSeen[name]] = i;
+                }
+                break;
+        }
+    }
+
+    lumps.push_back(checkNumForName("S_START"));
+    lumps.insert(lumps.end(), spriteLumps.begin(), spriteLumps.end());
+    lumps.push_back(checkNumForName("S_END"));
+
+    lumps.push_back(checkNumForName("F_START"));
+    lumps.insert(lumps.end(), flatLumps.begin(), flatLumps.end());
+    lumps.push_back(checkNumForName("F_END"));
+}
+
+// FNV-1a over the name of every listed lump and the size and contents of
+// the given ones, as LumpFingerprint in w_wad.zs computes it.
+uint32_t LumpDirectory::fingerprint(const std::set<uint32_t>& sized) const {
+    uint32_t hash = 2166136261U;
+    auto add = [&](uint8_t b) {
+        hash = (hash ^ b) * 16777619U;
+    };
+
+    for (const auto i : lumps) {
+        const auto& lump = all[i];
+        for (auto j = 0U; j < 8; j++) {
+            add(j < lump.name.size() ? lump.name[j] : 0);
+        }
+    }
+    for (const auto i : sized) {
+        const auto& lump = get(i);
+        for (auto j = 0U; j < 32; j += 8) {
+            add(lump.size >> j);
+        }
+        auto bytes = data(lump);
+        for (auto j = 0U; j < lump.size; j++) {
+            add(bytes[j]);
+        }
+    }
+    return hash;
+}
+
+const Lump& LumpDirectory::get(uint32_t lump) const {
+    if (lump >= lumps.size()) {
+        fail("bad lump number " + std::to_string(lump));
+    }
+    return all[lumps[lump]];
+}
+
+const char *LumpDirectory::data(const Lump& lump) const {
+    return files[lump.file].data() + lump.offset;
+}
+
+enum class Intrinsic {
+    None,
+    VaStart,
+    VaEnd,
+    UMin,
+    UMax,
+    SMin,
+    SMax,
+    Abs,
+    FShl,
+    USubSat,
+};
+
+// Functions the runtime provides that can run on the host.
+enum class Host {
+    PutChar,
+    GetTime,
+    Error,
+    Exit,
+    ZoneBase,
+    WadLoad,
+    WadReadLumps,
+    WadReadLumpSize,
+    WadReadLump,
+    InitSound,
+    GetCanvas,
+    SetPalette,
+    DivShifted,
+};
+
+static const std::map<std::string, Host> HOST_FUNCTIONS = {
+    { "_putchar", Host::PutChar },
+    { "I_GetTime", Host::GetTime },
+    { "I_Error", Host::Error },
+    { "I_Exit", Host::Exit },
+    { "I_ZoneBase", Host::ZoneBase },
+    { "W_Load", Host::WadLoad },
+    { "W_ReadLumps", Host::WadReadLumps },
+    { "W_ReadLumpSize", Host::WadReadLumpSize },
+    { "W_ReadLump", Host::WadReadLump },
+    { "I_InitSound", Host::InitSound },
+    { "I_GetCanvas", Host::GetCanvas },
+    { "I_SetPalette", Host::SetPalette },
+    { "M_DivShifted", Host::DivShifted },
+};
+
+// Where an operand comes from.
+struct Operand {
+    enum Kind {
+        Slot,
+        Constant,
+        Field,
+    } kind = Constant;
+    uint32_t value = 0;
+};
+
+// A jump to a block, with the values its phi nodes take.
+struct Edge {
+    uint32_t block;
+    std::vector<std::pair<uint32_t, Operand>> copies;
+};
+
+// An instruction decoded for quick execution.
+struct Op {
+    unsigned opcode;
+    // Where the result goes, if there is one.
+    bool hasResult = false;
+    uint32_t slot = 0;
+    // Bits in the result.
+    uint32_t width = 32;
+    // Bytes accessed by loads and stores.
+    uint32_t bytes = 0;
+    // Bits in the first operand.
+    uint32_t operandWidth = 32;
+    unsigned predicate = 0;
+    std::vector<Operand> operands;
+    // Scales of GEP operands after the first, and the constant offset or
+    // the size of an alloca.
+    std::vector<uint32_t> scales;
+    uint32_t offset = 0;
+    uint32_t align = 1;
+    // Direct callee, or else the first operand is the function index.
+    const llvm::Function *callee = nullptr;
+    Intrinsic intrinsic = Intrinsic::None;
+    uint32_t numParams = 0;
+    std::vector<uint32_t> cases;
+    std::vector<Edge> edges;
+};
+
+struct Code {
+    std::vector<std::vector<Op>> blocks;
+    uint32_t numSlots = 0;
+};
+
+// Runs LLVM IR directly, with the same memory layout as the generated code.
+class Machine {
+    const llvm::Module& m;
+    const llvm::DataLayout& layout;
+    const GlobalMemory& globals;
+    LumpDirectory& wads;
+
+    std::map<const llvm::Function *, Code> code;
+    std::map<uint32_t, const llvm::Function *> functionsByIndex;
+    std::map<const llvm::GlobalVariable *, uint32_t> fieldIndices;
+    std::map<const llvm::GlobalVariable *, uint32_t> tableAddresses;
+    std::string line;
+
+    const Code& decode(const llvm::Function& func);
+    Op decode(const llvm::Instruction& ins, const std::map<const llvm::Value *, uint32_t>& slots, const std::map<const llvm::BasicBlock *, uint32_t>& blocks);
+    Operand operand(const llvm::Value *value, const std::map<const llvm::Value *, uint32_t>& slots);
+    uint32_t constant(const llvm::Constant *c);
+
+    uint32_t callHost(const llvm::Function *f, const std::vector<uint32_t>& args, uint32_t va);
+
+    uint32_t load(uint32_t addr, uint32_t bytes) const;
+    void store(uint32_t addr, uint32_t value, uint32_t bytes);
+    uint32_t allocate(uint32_t size, uint32_t align);
+
+public:
+    std::vector<uint8_t> memory;
+    std::vector<const llvm::GlobalVariable *> fieldGlobals;
+    std::vector<uint32_t> fields;
+    std::vector<std::string> replay;
+    // Lumps whose size startup depends on.
+    std::set<uint32_t> sizedLumps;
+    uint32_t stack;
+    uint64_t executed = 0;
+
+    Machine(const llvm::Module& m, const GlobalMemory& globals, LumpDirectory& wads);
+
+    uint32_t call(const llvm::Function *f, const std::vector<uint32_t>& args, uint32_t va);
+};
+
+Machine::Machine(const llvm::Module& m, const GlobalMemory& globals, LumpDirectory& wads)
+    : m(m)
+    , layout(m.getDataLayout())
+    , globals(globals)
+    , wads(wads)
+    , memory(globals.memorySize())
+    , stack(globals.memorySize()) {
+    globals.copyMemory(memory.data());
+
+    // Tables are not in memory, so they are kept past its end here. Their
+    // addresses are never stored, so the image does not depend on them.
+    for (const auto& [_, table] : globals.constantTables()) {
+        tableAddresses[table.global] = memory.size();
+        for (const auto value : table.values) {
+            for (auto i = 0U; i < table.elementBytes; i++) {
+                memory.push_back(value >> (i * 8));
+            }
+        }
+    }
+
+    for (const auto& func : m) {
+        if (func.hasAddressTaken()) {
+            functionsByIndex[globals.getFuncIndex(&func)] = &func;
+        }
+    }
+
+    for (const auto& [_, global] : globals.promotedGlobals()) {
+        fieldIndices[global] = fieldGlobals.size();
+        fieldGlobals.push_back(global);
+        fields.push_back(globals.constantValue(global->getInitializer(), layout));
+    }
+}
+
+uint32_t Machine::constant(const llvm::Constant *c) {
+    if (auto v = llvm::dyn_cast<llvm::ConstantInt>(c)) {
+        return uint32_t(v->getZExtValue());
+    } else if (auto v = llvm::dyn_cast<llvm::ConstantExpr>(c)) {
+        if (v->getOpcode() == llvm::Instruction::PtrToInt || v->getOpcode() == llvm::Instruction::IntToPtr) {
+            return constant(v->getOperand(0));
+        }
+    } else if (llvm::isa<llvm::UndefValue>(c)) {
+        return 0;
+    }
+
+    auto base = c;
+    if (auto gep = llvm::dyn_cast<llvm::GEPOperator>(c)) {
+        base = llvm::cast<llvm::Constant>(gep->getPointerOperand());
+    }
+    if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(base)) {
+        auto it = tableAddresses.find(global);
+        if (it != tableAddresses.end()) {
+            llvm::APInt offset(32, 0);
+            if (auto gep = llvm::dyn_cast<llvm::GEPOperator>(c)) {
+                gep->accumulateConstantOffset(layout, offset);
+            }
+            return it->second + offset.getZExtValue();
+        }
+    }
+    return globals.constantValue(c, layout);
+}
+
+Operand Machine::operand(const llvm::Value *value, const std::map<const llvm::Value *, uint32_t>& slots) {
+    if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(value)) {
+        auto it = fieldIndices.find(global);
+        if (it != fieldIndices.end()) {
+            return { Operand::Field, it->second };
+        }
+    }
+    if (auto c = llvm::dyn_cast<llvm::Constant>(value)) {
+        return { Operand::Constant, constant(c) };
+    }
+    auto it = slots.find(value);
+    if (it == slots.end()) {
+        fail("unknown value");
+    }
+    return { Operand::Slot, it->second };
+}
+
+const Code& Machine::decode(const llvm::Function& func) {
+    auto it = code.find(&func);
+    if (it != code.end())
+        return it->second;
+
+    auto& result = code[&func];
+
+    std::map<const llvm::Value *, uint32_t> slots;
+    std::map<const llvm::BasicBlock *, uint32_t> blocks;
+    for (const auto& arg : func.args()) {
+        slots[&arg] = result.numSlots++;
+    }
+    for (const auto& block : func) {
+        blocks[&block] = blocks.size();
+        for (const auto& ins : block) {
+            if (!ins.getType()->isVoidTy()) {
+                slots[&ins] = result.numSlots++;
+            }
+        }
+    }
+
+    for (const auto& block : func) {
+        auto& ops = result.blocks.emplace_back();
+        for (const auto& ins : block) {
+            // Phi nodes are assigned when jumping to the block.
+            if (!llvm::isa<llvm::PHINode>(ins)) {
+                ops.push_back(decode(ins, slots, blocks));
+            }
+        }
+    }
+
+    return result;
+}
+
+Op Machine::decode(const llvm::Instruction& ins, const std::map<const llvm::Value *, uint32_t>& slots, const std::map<const llvm::BasicBlock *, uint32_t>& blocks) {
+    Op op;
+    op.opcode = ins.getOpcode();
+    if (!ins.getType()->isVoidTy()) {
+        op.hasResult = true;
+        op.slot = slots.at(&ins);
+        if (ins.getType()->isSized()) {
+            op.width = layout.getTypeSizeInBits(ins.getType()).getFixedValue();
+        }
+    }
+    if (ins.getNumOperands() > 0 && ins.getOperand(0)->getType()->isSized()) {
+        op.operandWidth = layout.getTypeSizeInBits(ins.getOperand(0)->getType()).getFixedValue();
+    }
+
+    auto edge = [&](const llvm::BasicBlock *to) {
+        Edge e;
+        e.block = blocks.at(to);
+        for (const auto& phi : to->phis()) {
+            e.copies.emplace_back(slots.at(&phi), operand(phi.getIncomingValueForBlock(ins.getParent()), slots));
+        }
+        return e;
+    };
+
+    switch (op.opcode) {
+        case llvm::Instruction::Load:
+            op.bytes = layout.getTypeStoreSize(ins.getType()).getFixedValue();
+            op.operands.push_back(operand(ins.getOperand(0), slots));
+            break;
+
+        case llvm::Instruction::Store:
+            op.bytes = layout.getTypeStoreSize(ins.getOperand(0)->getType()).getFixedValue();
+            op.operands.push_back(operand(ins.getOperand(0), slots));
+            op.operands.push_back(operand(ins.getOperand(1), slots));
+            break;
+
+        case llvm::Instruction::GetElementPtr: {
+            auto& gep = llvm::cast<llvm::GetElementPtrInst>(ins);
+            llvm::APInt constantOffset(32, 0);
+            llvm::MapVector<llvm::Value *, llvm::APInt> offsets;
+            if (!gep.collectOffset(layout, 32, offsets, constantOffset)) {
+                fail("failed to read GEP offset");
+            }
+            op.operands.push_back(operand(gep.getPointerOperand(), slots));
+            for (auto& [value, scale] : offsets) {
+                op.operands.push_back(operand(value, slots));
+                op.scales.push_back(uint32_t(scale.getSExtValue()));
+            }
+            op.offset = uint32_t(constantOffset.getSExtValue());
+            break;
+        }
+
+        case llvm::Instruction::Alloca: {
+            auto& allocaIns = llvm::cast<llvm::AllocaInst>(ins);
+            auto size = allocaIns.getAllocationSize(layout);
+            if (size == std::nullopt) {
+                fail("bad alloca");
+            }
+            op.offset = size.value();
+            op.align = allocaIns.getAlign().value();
+            break;
+        }
+
+        case llvm::Instruction::Call: {
+            auto& call = llvm::cast<llvm::CallInst>(ins);
+            if (auto f = call.getCalledFunction()) {
+                auto name = f->getName();
+                if (name.starts_with("llvm.")) {
+                    if (name.equals("llvm.va_start")) {
+                        op.intrinsic = Intrinsic::VaStart;
+                    } else if (name.equals("llvm.va_end")) {
+                        op.intrinsic = Intrinsic::VaEnd;
+                    } else if (name.starts_with("llvm.umin.")) {
+                        op.intrinsic = Intrinsic::UMin;
+                    } else if (name.starts_with("llvm.umax.")) {
+                        op.intrinsic = Intrinsic::UMax;
+                    } else if (name.starts_with("llvm.smin.")) {
+                        op.intrinsic = Intrinsic::SMin;
+                    } else if (name.starts_with("llvm.smax.")) {
+                        op.intrinsic = Intrinsic::SMax;
+                    } else if (name.starts_with("llvm.abs.")) {
+                        op.intrinsic = Intrinsic::Abs;
+                    } else if (name.starts_with("llvm.fshl.")) {
+                        op.intrinsic = Intrinsic::FShl;
+                    } else if (name.starts_with("llvm.usub.sat.")) {
+                        op.intrinsic = Intrinsic::USubSat;
+                    } else {
+                        fail("unsupported intrinsic " + name.str());
+                    }
+                } else {
+                    op.callee = f;
+                }
+            } else {
+                op.operands.push_back(operand(call.getCalledOperand(), slots));
+            }
+            op.numParams = call.getFunctionType()->getNumParams();
+            for (const auto& arg : call.args()) {
+                op.operands.push_back(operand(arg, slots));
+            }
+            if (call.arg_size() > 0) {
+                op.operandWidth = layout.getTypeSizeInBits(call.getArgOperand(0)->getType()).getFixedValue();
+            }
+            break;
+        }
+
+        case llvm::Instruction::ICmp:
+            op.predicate = llvm::cast<llvm::ICmpInst>(ins).getPredicate();
+            op.operands.push_back(operand(ins.getOperand(0), slots));
+            op.operands.push_back(operand(ins.getOperand(1), slots));
+            break;
+
+        case llvm::Instruction::Br: {
+            auto& br = llvm::cast<llvm::BranchInst>(ins);
+            if (br.isConditional()) {
+                op.operands.push_back(operand(br.getCondition(), slots));
+            }
+            for (auto i = 0U; i < br.getNumSuccessors(); i++) {
+                op.edges.push_back(edge(br.getSuccessor(i)));
+            }
+            break;
+        }
+
+        case llvm::Instruction::Switch: {
+            auto& sw = llvm::cast<llvm::SwitchInst>(ins);
+            op.operands.push_back(operand(sw.getCondition(), slots));
+            op.edges.push_back(edge(sw.getDefaultDest()));
+            for (const auto& c : sw.cases()) {
+                op.cases.push_back(uint32_t(c.getCaseValue()->getZExtValue()));
+                op.edges.push_back(edge(c.getCaseSuccessor()));
+            }
+            break;
+        }
+
+        case llvm::Instruction::Add:
+        case llvm::Instruction::Sub:
+        case llvm::Instruction::Mul:
+        case llvm::Instruction::UDiv:
+        case llvm::Instruction::SDiv:
+        case llvm::Instruction::URem:
+        case llvm::Instruction::SRem:
+        case llvm::Instruction::Shl:
+        case llvm::Instruction::LShr:
+        case llvm::Instruction::AShr:
+        case llvm::Instruction::And:
+        case llvm::Instruction::Or:
+        case llvm::Instruction::Xor:
+        case llvm::Instruction::Select:
+        case llvm::Instruction::ZExt:
+        case llvm::Instruction::SExt:
+        case llvm::Instruction::Trunc:
+        case llvm::Instruction::PtrToInt:
+        case llvm::Instruction::IntToPtr:
+        case llvm::Instruction::Freeze:
+        case llvm::Instruction::Ret:
+        case llvm::Instruction::Unreachable:
+            for (const auto& value : ins.operands()) {
+                op.operands.push_back(operand(value, slots));
+            }
+            break;
+
+        default:
+            fail(std::string("unsupported instruction ") + ins.getOpcodeName());
+    }
+
+    return op;
+}
+
+uint32_t Machine::load(uint32_t addr, uint32_t bytes) const {
+    if (addr > memory.size() - bytes) {
+        fail("out of bounds load at " + std::to_string(addr));
+    }
+    uint32_t value = 0;
+    for (auto i = 0U; i < bytes; i++) {
+        value |= uint32_t(memory[addr + i]) << (i * 8);
+    }
+    return value;
+}
+
+void Machine::store(uint32_t addr, uint32_t value, uint32_t bytes) {
+    if (addr > memory.size() - bytes) {
+        fail("out of bounds store at " + std::to_string(addr));
+    }
+    for (auto i = 0U; i < bytes; i++) {
+        memory[addr + i] = value >> (i * 8);
+    }
+}
+
+uint32_t Machine::allocate(uint32_t size, uint32_t align) {
+    stack = (stack - size) & ~(align - 1);
+    if (stack < globals.zoneEnd()) {
+        fail("stack overflow");
+    }
+    return stack;
+}
+
+uint32_t Machine::call(const llvm::Function *f, const std::vector<uint32_t>& args, uint32_t va) {
+    if (f->isDeclaration())
+        return callHost(f, args, va);
+
+    const auto& c = decode(*f);
+    std::vector<uint32_t> slots(c.numSlots);
+    std::copy(args.begin(), args.end(), slots.begin());
+    auto savedStack = stack;
+
+    auto get = [&](const Operand& o) {
+        switch (o.kind) {
+            case Operand::Slot:
+                return slots[o.value];
+            case Operand::Field:
+                return fields[o.value];
+            default:
+                return o.value;
+        }
+    };
+
+    auto jump = [&](const Edge& e) {
+        // Phi nodes take their values all at once.
+        std::vector<uint32_t> values;
+        for (const auto& [_, value] : e.copies) {
+            values.push_back(get(value));
+        }
+        for (auto i = 0U; i < values.size(); i++) {
+            slots[e.copies[i].first] = values[i];
+        }
+        return e.block;
+    };
+
+    uint32_t block = 0;
+    for (;;) {
+        const auto& ops = c.blocks[block];
+        for (const auto& op : ops) {
+            executed++;
+            uint32_t result = 0;
+            switch (op.opcode) {
+                case llvm::Instruction::Add:
+                    result = get(op.operands[0]) + get(op.operands[1]);
+                    break;
+                case llvm::Instruction::Sub:
+                    result = get(op.operands[0]) - get(op.operands[1]);
+                    break;
+                case llvm::Instruction::Mul:
+                    result = get(op.operands[0]) * get(op.operands[1]);
+                    break;
+                case llvm::Instruction::UDiv:
+                case llvm::Instruction::URem: {
+                    auto a = get(op.operands[0]);
+                    auto b = get(op.operands[1]);
+                    if (b == 0) {
+                        fail("division by zero in " + f->getName().str());
+                    }
+                    result = op.opcode == llvm::Instruction::UDiv ? a / b : a % b;
+                    break;
+                }
+                case llvm::Instruction::SDiv:
+                case llvm::Instruction::SRem: {
+                    auto a = signExtend(get(op.operands[0]), op.width);
+                    auto b = signExtend(get(op.operands[1]), op.width);
+                    if (b == 0 || (a == INT32_MIN && b == -1)) {
+                        fail("division overflow in " + f->getName().str());
+                    }
+                    result = op.opcode == llvm::Instruction::SDiv ? a / b : a % b;
+                    break;
+                }
+                case llvm::Instruction::Shl:
+                    result = get(op.operands[0]) << (get(op.operands[1]) & 31);
+                    break;
+                case llvm::Instruction::LShr:
+                    result = get(op.operands[0]) >> (get(op.operands[1]) & 31);
+                    break;
+                case llvm::Instruction::AShr:
+                    result = signExtend(get(op.operands[0]), op.width) >> (get(op.operands[1]) & 31);
+                    break;
+                case llvm::Instruction::And:
+                    result = get(op.operands[0]) & get(op.operands[1]);
+                    break;
+                case llvm::Instruction::Or:
+                    result = get(op.operands[0]) | get(op.operands[1]);
+                    break;
+                case llvm::Instruction::Xor:
+                    result = get(op.operands[0]) ^ get(op.operands[1]);
+                    break;
+
+                case llvm::Instruction::ICmp: {
+                    auto a = get(op.operands[0]);
+                    auto b = get(op.operands[1]);
+                    auto sa = signExtend(a, op.operandWidth);
+                    auto sb = signExtend(b, op.operandWidth);
+                    switch (op.predicate) {
+                        case llvm::ICmpInst::ICMP_EQ: result = a == b; break;
+                        case llvm::ICmpInst::ICMP_NE: result = a != b; break;
+                        case llvm::ICmpInst::ICMP_ULT: result = a < b; break;
+                        case llvm::ICmpInst::ICMP_ULE: result = a <= b; break;
+                        case llvm::ICmpInst::ICMP_UGT: result = a > b; break;
+                        case llvm::ICmpInst::ICMP_UGE: result = a >= b; break;
+                        case llvm::ICmpInst::ICMP_SLT: result = sa < sb; break;
+                        case llvm::ICmpInst::ICMP_SLE: result = sa <= sb; break;
+                        case llvm::ICmpInst::ICMP_SGT: result = sa > sb; break;
+                        case llvm::ICmpInst::ICMP_SGE: result = sa >= sb; break;
+                        default: fail("unsupported comparison");
+                    }
+                    break;
+                }
+
+                case llvm::Instruction::Select:
+                    result = get(op.operands[0]) ? get(op.operands[1]) : get(op.operands[2]);
+                    break;
+                case llvm::Instruction::ZExt:
+                case llvm::Instruction::IntToPtr:
+                case llvm::Instruction::Freeze:
+                case llvm::Instruction::Trunc:
+                case llvm::Instruction::PtrToInt:
+                    result = get(op.operands[0]);
+                    break;
+                case llvm::Instruction::SExt:
+                    result = signExtend(get(op.operands[0]), op.operandWidth);
+                    break;
+
+                case llvm::Instruction::Load: {
+                    const auto& ptr = op.operands[0];
+                    if (ptr.kind == Operand::Field) {
+                        result = fields[ptr.value];
+                    } else {
+                        result = load(get(ptr), op.bytes);
+                        // Booleans are whether the byte is set.
+                        if (op.width == 1) {
+                            result = result != 0;
+                        }
+                    }
+                    break;
+                }
+                case llvm::Instruction::Store: {
+                    auto value = get(op.operands[0]);
+                    const auto& ptr = op.operands[1];
+                    if (ptr.kind == Operand::Field) {
+                        fields[ptr.value] = value;
+                    } else {
+                        store(get(ptr), value, op.bytes);
+                    }
+                    continue;
+                }
+                case llvm::Instruction::GetElementPtr:
+                    result = get(op.operands[0]) + op.offset;
+                    for (auto i = 0U; i < op.scales.size(); i++) {
+                        result += get(op.operands[i + 1]) * op.scales[i];
+                    }
+                    break;
+                case llvm::Instruction::Alloca:
+                    result = allocate(op.offset, op.align);
+                    break;
+
+                case llvm::Instruction::Call: {
+                    if (op.intrinsic != Intrinsic::None) {
+                        auto a = op.operands.size() > 0 ? get(op.operands[0]) : 0;
+                        auto b = op.operands.size() > 1 ? get(op.operands[1]) : 0;
+                        auto sa = signExtend(a, op.operandWidth);
+                        auto sb = signExtend(b, op.operandWidth);
+                        switch (op.intrinsic) {
+                            case Intrinsic::VaStart: store(a, va, 4); continue;
+                            case Intrinsic::VaEnd: store(a, 0, 4); continue;
+                            case Intrinsic::UMin: result = a < b ? a : b; break;
+                            case Intrinsic::UMax: result = a > b ? a : b; break;
+                            case Intrinsic::SMin: result = sa < sb ? a : b; break;
+                            case Intrinsic::SMax: result = sa > sb ? a : b; break;
+                            case Intrinsic::Abs: result = sa < 0 ? -uint32_t(sa) : sa; break;
+                            case Intrinsic::FShl: {
+                                auto s = get(op.operands[2]);
+                                result = (a << (s & 31)) | (b >> ((32 - s) & 31));
+                                break;
+                            }
+                            case Intrinsic::USubSat: result = a < b ? 0 : a - b; break;
+                            default: break;
+                        }
+                        break;
+                    }
+
+                    auto callee = op.callee;
+                    auto first = 0U;
+                    if (callee == nullptr) {
+                        auto index = get(op.operands[0]);
+                        auto it = functionsByIndex.find(index);
+                        if (it == functionsByIndex.end()) {
+                            fail("called bad function pointer " + std::to_string(index));
+                        }
+                        callee = it->second;
+                        first = 1;
+                    }
+
+                    std::vector<uint32_t> args;
+                    for (auto i = 0U; i < op.numParams; i++) {
+                        args.push_back(get(op.operands[first + i]));
+                    }
+
+                    // Extra arguments go in a block on the stack.
+                    auto callStack = stack;
+                    uint32_t extra = 0;
+                    auto numExtra = op.operands.size() - first - op.numParams;
+                    if (numExtra > 0) {
+                        extra = allocate(numExtra * 4, 4);
+                        for (auto i = 0U; i < numExtra; i++) {
+                            store(extra + i * 4, get(op.operands[first + op.numParams + i]), 4);
+                        }
+                    }
+
+                    result = call(callee, args, extra);
+                    stack = callStack;
+                    break;
+                }
+
+                case llvm::Instruction::Br:
+                    if (op.operands.empty() || get(op.operands[0])) {
+                        block = jump(op.edges[0]);
+                    } else {
+                        block = jump(op.edges[1]);
+                    }
+                    goto next;
+
+                case llvm::Instruction::Switch: {
+                    auto value = get(op.operands[0]);
+                    auto taken = 0U;
+                    for (auto i = 0U; i < op.cases.size(); i++) {
+                        if (op.cases[i] == value) {
+                            taken = i + 1;
+                            break;
+                        }
+                    }
+                    block = jump(op.edges[taken]);
+                    goto next;
+                }
+
+                case llvm::Instruction::Ret:
+                    stack = savedStack;
+                    return op.operands.empty() ? 0 : get(op.operands[0]);
+
+                case llvm::Instruction::Unreachable:
+                    fail("reached unreachable code in " + f->getName().str());
+            }
+            if (op.hasResult) {
+                slots[op.slot] = truncate(result, op.width);
+            }
+        }
+        fail("fell off the end of a block in " + f->getName().str());
+    next:;
+    }
+}
+
+// The quotient of a shifted left by the given amount, as in m_fixed.zs.
+static uint32_t divShifted(uint32_t a, uint32_t shift, uint32_t b) {
+    if (b == 0) {
+        fail("division by zero");
+    }
+    return uint32_t((int64_t(int32_t(a)) * (int64_t(1) << shift)) / int32_t(b));
+}
+
+uint32_t Machine::callHost(const llvm::Function *f, const std::vector<uint32_t>& args, uint32_t va) {
+    auto name = f->getName().str();
+    auto it = HOST_FUNCTIONS.find(name);
+    if (it == HOST_FUNCTIONS.end()) {
+        fail(name + " cannot run during startup");
+    }
+
+    switch (it->second) {
+        case Host::PutChar:
+            if (args[0] == 10) {
+                printf("%s\n", line.c_str());
+                line.clear();
+            } else if (args[0] >= 0x20 && args[0] <= 0x7e) {
+                line += char(args[0]);
+            }
+            return 0;
+
+        case Host::GetTime:
+            return 0;
+
+        case Host::Error: {
+            auto vsnprintf = m.getFunction("M_vsnprintf");
+            if (vsnprintf == nullptr || vsnprintf->isDeclaration()) {
+                fail("I_Error was called");
+            }
+            auto buffer = allocate(ERROR_MESSAGE_BUF_SIZE, 1);
+            call(vsnprintf, { buffer, ERROR_MESSAGE_BUF_SIZE, args[0], va }, 0);
+            std::string message;
+            for (auto addr = buffer; memory[addr] != 0; addr++) {
+                message += char(memory[addr]);
+            }
+            fail("I_Error: " + message);
+        }
+
+        case Host::Exit:
+            fail("I_Exit was called");
+
+        case Host::ZoneBase:
+            store(args[0], globals.zoneEnd() - globals.zoneBase(), 4);
+            return globals.zoneBase();
+
+        case Host::WadLoad:
+            wads.build();
+            return wads.lumps.size();
+
+        case Host::WadReadLumps: {
+            auto addr = args[0];
+            for (auto i = 0U; i < wads.lumps.size(); i++) {
+                const auto& lump = wads.get(i);
+                for (auto j = 0U; j < 8; j++) {
+                    store(addr++, j < lump.name.size() ? lump.name[j] : 0, 1);
+                }
+                // Sizes are asked for when needed, as in w_wad.zs.
+                store(addr, 0xffffffff, 4);
+                addr += 12;
+            }
+            return 0;
+        }
+
+        case Host::WadReadLumpSize:
+            sizedLumps.insert(args[0]);
+            return wads.get(args[0]).size;
+
+        case Host::WadReadLump: {
+            const auto& lump = wads.get(args[0]);
+            sizedLumps.insert(args[0]);
+            if (args[1] > memory.size() - lump.size) {
+                fail("out of bounds lump read");
+            }
+            std::copy(wads.data(lump), wads.data(lump) + lump.size, memory.begin() + args[1]);
+            return 0;
+        }
+
+        // These only set up the runtime, so they are made again on resume.
+        case Host::InitSound:
+            replay.push_back("func_I_InitSound(" + std::to_string(args[0]) + "U);");
+            return 0;
+
+        case Host::GetCanvas:
+            replay.push_back("func_I_GetCanvas();");
+            return 0;
+
+        case Host::SetPalette:
+            replay.push_back("func_I_SetPalette(" + std::to_string(args[0]) + "U);");
+            return 0;
+
+        case Host::DivShifted:
+            return divShifted(args[0], args[1], args[2]);
+    }
+
+    return 0;
+}
+
+// The program is started up to the point where D_DoomStart takes over.
+static const char *SNAPSHOT_ENTRY = "D_DoomInit";
+
+void Snapshot::take(const llvm::Module& m, const GlobalMemory& memory, const std::vector<const char *>& files) {
+    LumpDirectory wads;
+    for (const auto file : files) {
+        wads.add(file);
+    }
+    wads.build();
+
+    auto entry = m.getFunction(SNAPSHOT_ENTRY);
+    if (entry == nullptr || entry->isDeclaration()) {
+        fail(std::string(SNAPSHOT_ENTRY) + " is not defined");
+    }
+
+    Machine machine(m, memory, wads);
+    machine.call(entry, {}, 0);
+
+    // Nothing past the zone heap is live once startup returns.
+    auto end = memory.zoneEnd();
+    while (end > MIN_VALID_MEMORY && machine.memory[end - 1] == 0) {
+        end--;
+    }
+    image.assign(machine.memory.begin() + MIN_VALID_MEMORY, machine.memory.begin() + end);
+
+    for (auto i = 0U; i < machine.fields.size(); i++) {
+        if (machine.fields[i] != 0) {
+            fields[*memory.getField(machine.fieldGlobals[i]->getName().str())] = machine.fields[i];
+        }
+    }
+    replay = std::move(machine.replay);
+    sizedLumps.assign(machine.sizedLumps.begin(), machine.sizedLumps.end());
+    fingerprint = wads.fingerprint(machine.sizedLumps);
+    taken = true;
+
+    printf("Took snapshot after %llu instructions, %zu bytes of memory\n", (unsigned long long) machine.executed, image.size());
+}
+
+void Snapshot::save(const std::string& fileName, ImageFormat format) const {
+    if (!taken) {
+        std::error_code ec;
+        std::filesystem::remove(fileName, ec);
+        return;
+    }
+
+    std::ofstream file(fileName, std::ios::binary);
+    if (file.fail()) {
+        fprintf(stderr, "Failed to open %s\n", fileName.c_str());
+        exit(EXIT_FAILURE);
+    }
+    auto put32 = [&](uint32_t value) {
+        for (auto i = 0U; i < 32; i += 8) {
+            file.put(char(value >> i));
+        }
+    };
+    put32(fingerprint);
+    put32(sizedLumps.size());
+    for (const auto lump : sizedLumps) {
+        put32(lump);
+    }
+    writeImage(file, image.data(), image.size(), format, "snapshot.bin");
+}
+
+void Snapshot::writeResume(std::ostream& out) const {
+    out << "void loadSnapshotFields(){\n";
+    for (const auto& [field, value] : fields) {
+        out << field << "=" << value << "U;\n";
+    }
+    out << "}\n";
+
+    out << "void resumeSnapshot(){\n";
+    for (const auto& call : replay) {
+        out << call << "\n";
+    }
+    out << "}\n";
+}
@@ -0,0 +1,46 @@
+#ifndef CONVERTER_SNAPSHOT_H
+#define CONVERTER_SNAPSHOT_H
+
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "options.hpp"
+
+namespace llvm {
+    class Module;
+}
+
+class GlobalMemory;
+
+// Runs the program's startup on the host and keeps the state it leaves
+// behind, so the game can resume from there instead of starting up. The
+// startup reads the WAD files, so the result is only valid for the same lumps.
+class Snapshot {
+    bool taken = false;
+    // Hash of the lumps the snapshot was taken with.
+    uint32_t fingerprint = 0;
+    // Lumps whose size went into the hash, as those startup read.
+    std::vector<uint32_t> sizedLumps;
+    // Memory from MIN_VALID_MEMORY up to the last byte that is not zero.
+    std::vector<uint8_t> image;
+    // Values of fields that are not zero, by field name.
+    std::map<std::string, uint32_t> fields;
+    // Calls into the runtime made during startup, to be made again on resume.
+    std::vector<std::string> replay;
+
+public:
+    // Run D_DoomInit with the given WAD and lump files loaded in order.
+    void take(const llvm::Module& m, const GlobalMemory& memory, const std::vector<const char *>& files);
+
+    // Write the fingerprint, the lumps it covers and the memory image, or remove an old image if no
+    // snapshot was taken.
+    void save(const std::string& fileName, ImageFormat format) const;
+
+    // Write the functions restoring fields and runtime state on resume.
+    void writeResume(std::ostream& out) const;
+};
+
+#endif
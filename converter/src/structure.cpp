@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+
+#include "structure.hpp"
+
+Structurizer::Structurizer(const llvm::Function& func) : func(func) {
+    computeOrder();
+    computeDominators();
+
+    for (const auto block : rpo) {
+        std::set<const llvm::BasicBlock *> seen;
+        for (const auto succ : llvm::successors(block)) {
+            // Count each predecessor once, even if it has several edges here.
+            if (!seen.insert(succ).second)
+                continue;
+
+            if (isBackEdge(block, succ)) {
+                loopHeaders[succ] = true;
+            } else {
+                forwardPreds[succ]++;
+            }
+        }
+    }
+
+    // Blocks with more than one way in are placed after the region of their
+    // immediate dominator, in reverse postorder.
+    for (const auto block : rpo) {
+        if (forwardPreds[block] > 1) {
+            mergeChildren[idom.at(block)].push_back(block);
+        }
+    }
+}
+
+void Structurizer::computeOrder() {
+    std::vector<const llvm::BasicBlock *> postorder;
+    std::set<const llvm::BasicBlock *> visited;
+    std::vector<std::pair<const llvm::BasicBlock *, llvm::const_succ_iterator>> stack;
+
+    auto entry = &func.getEntryBlock();
+    visited.insert(entry);
+    stack.emplace_back(entry, llvm::succ_begin(entry));
+
+    while (!stack.empty()) {
+        auto& [block, it] = stack.back();
+        if (it != llvm::succ_end(block)) {
+            auto succ = *it++;
+            if (visited.insert(succ).second) {
+                stack.emplace_back(succ, llvm::succ_begin(succ));
+            }
+        } else {
+            postorder.push_back(block);
+            stack.pop_back();
+        }
+    }
+
+    rpo.assign(postorder.rbegin(), postorder.rend());
+    for (auto i = 0U; i < rpo.size(); i++) {
+        order[rpo[i]] = i;
+    }
+}
+
+void Structurizer::computeDominators() {
+    // Cooper, Harvey and Kennedy's iterative algorithm.
+    auto entry = rpo.front();
+    idom[entry] = entry;
+
+    auto intersect = [&](const llvm::BasicBlock *a, const llvm::BasicBlock *b) {
+        while (a != b) {
+            while (order.at(a) > order.at(b))
+                a = idom.at(a);
+            while (order.at(b) > order.at(a))
+                b = idom.at(b);
+        }
+        return a;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto i = 1U; i < rpo.size(); i++) {
+            auto block = rpo[i];
+            const llvm::BasicBlock *newIdom = nullptr;
+            for (const auto pred : llvm::predecessors(block)) {
+                if (idom.find(pred) == idom.end())
+                    continue;
+                newIdom = newIdom ? intersect(pred, newIdom) : pred;
+            }
+
+            auto& current = idom[block];
+            if (current != newIdom) {
+                current = newIdom;
+                changed = true;
+            }
+        }
+    }
+}
+
+bool Structurizer::dominates(const llvm::BasicBlock *a, const llvm::BasicBlock *b) const {
+    for (;;) {
+        if (a == b)
+            return true;
+        auto next = idom.at(b);
+        if (next == b)
+            return false;
+        b = next;
+    }
+}
+
+bool Structurizer::isBackEdge(const llvm::BasicBlock *from, const llvm::BasicBlock *to) const {
+    return dominates(to, from);
+}
+
+bool Structurizer::isReducible() const {
+    for (const auto block : rpo) {
+        for (const auto succ : llvm::successors(block)) {
+            // Any edge going backwards in reverse postorder must go to a block
+            // dominating it, otherwise the loop has multiple entries.
+            if (order.at(succ) <= order.at(block) && !dominates(succ, block))
+                return false;
+        }
+
+        auto t = block->getTerminator();
+        if (!llvm::isa<llvm::BranchInst>(t) && !llvm::isa<llvm::SwitchInst>(t) &&
+            !llvm::isa<llvm::ReturnInst>(t) && !llvm::isa<llvm::UnreachableInst>(t))
+            return false;
+    }
+    return true;
+}
+
+std::unique_ptr<Stmt> Structurizer::structure() {
+    return doTree(rpo.front());
+}
+
+std::unique_ptr<Stmt> Structurizer::doTree(const llvm::BasicBlock *block) {
+    auto body = nodeWithin(block, mergeChildren[block].size());
+    if (!loopHeaders[block])
+        return body;
+
+    auto loop = std::make_unique<Stmt>(StmtKind::Loop, block);
+    loop->children.push_back(std::move(body));
+    return loop;
+}
+
+std::unique_ptr<Stmt> Structurizer::nodeWithin(const llvm::BasicBlock *block, size_t merges) {
+    auto seq = std::make_unique<Stmt>(StmtKind::Seq, block);
+
+    if (merges == 0) {
+        seq->children.push_back(std::make_unique<Stmt>(StmtKind::Code, block));
+        seq->children.push_back(terminator(block));
+    } else {
+        // The last merge child in reverse postorder encloses the others.
+        auto follow = mergeChildren.at(block)[merges - 1];
+        auto region = std::make_unique<Stmt>(StmtKind::Block, follow);
+        region->children.push_back(nodeWithin(block, merges - 1));
+        seq->children.push_back(std::move(region));
+        seq->children.push_back(doTree(follow));
+    }
+
+    return seq;
+}
+
+std::unique_ptr<Stmt> Structurizer::doBranch(const llvm::BasicBlock *from, const llvm::BasicBlock *to) {
+    auto edge = std::make_unique<Stmt>(StmtKind::Edge, to);
+    edge->from = from;
+
+    if (isBackEdge(from, to)) {
+        edge->edge = EdgeKind::Back;
+        return edge;
+    }
+
+    if (forwardPreds.at(to) > 1) {
+        edge->edge = EdgeKind::Merge;
+        return edge;
+    }
+
+    // Only one way in, so the target's code can go right here.
+    auto seq = std::make_unique<Stmt>(StmtKind::Seq, to);
+    seq->children.push_back(std::move(edge));
+    seq->children.push_back(doTree(to));
+    return seq;
+}
+
+std::unique_ptr<Stmt> Structurizer::terminator(const llvm::BasicBlock *block) {
+    auto t = block->getTerminator();
+
+    if (auto ins = llvm::dyn_cast<llvm::BranchInst>(t)) {
+        if (ins->isUnconditional() || ins->getSuccessor(0) == ins->getSuccessor(1)) {
+            return doBranch(block, ins->getSuccessor(0));
+        }
+
+        auto stmt = std::make_unique<Stmt>(StmtKind::If, block);
+        stmt->children.push_back(doBranch(block, ins->getSuccessor(0)));
+        stmt->children.push_back(doBranch(block, ins->getSuccessor(1)));
+        return stmt;
+    }
+
+    if (auto ins = llvm::dyn_cast<llvm::SwitchInst>(t)) {
+        auto stmt = std::make_unique<Stmt>(StmtKind::Switch, block);
+        auto defaultDest = ins->getDefaultDest();
+
+        // Group the cases by destination. Cases going to the default
+        // destination can be left to the default arm.
+        std::vector<const llvm::BasicBlock *> dests;
+        for (const auto& c : ins->cases()) {
+            auto dest = c.getCaseSuccessor();
+            if (dest == defaultDest)
+                continue;
+
+            auto it = std::find(dests.begin(), dests.end(), dest);
+            auto index = it - dests.begin();
+            if (it == dests.end()) {
+                dests.push_back(dest);
+                stmt->cases.emplace_back();
+            }
+            stmt->cases[index].push_back(c.getCaseValue()->getZExtValue());
+        }
+
+        for (const auto dest : dests) {
+            stmt->children.push_back(doBranch(block, dest));
+        }
+        stmt->children.push_back(doBranch(block, defaultDest));
+        return stmt;
+    }
+
+    if (llvm::isa<llvm::ReturnInst>(t)) {
+        return std::make_unique<Stmt>(StmtKind::Return, block);
+    }
+
+    if (llvm::isa<llvm::UnreachableInst>(t)) {
+        return std::make_unique<Stmt>(StmtKind::Unreachable, block);
+    }
+
+    fprintf(stderr, "Unsupported opcode\n");
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,91 @@
+#ifndef CONVERTER_STRUCTURE_H
+#define CONVERTER_STRUCTURE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace llvm {
+    class BasicBlock;
+    class Function;
+}
+
+enum class StmtKind {
+    // Children run in order.
+    Seq,
+    // The non-terminator instructions of a block.
+    Code,
+    // A control-flow edge between two blocks.
+    Edge,
+    // The conditional branch ending a block. Children are the then and else arms.
+    If,
+    // The switch ending a block. The default arm is the last child.
+    Switch,
+    // A loop whose header is the given block.
+    Loop,
+    // A region that the given block follows.
+    Block,
+    // The return ending a block.
+    Return,
+    // The unreachable instruction ending a block.
+    Unreachable,
+};
+
+enum class EdgeKind {
+    // The target's code follows immediately.
+    Inline,
+    // Jump forward to a merge block.
+    Merge,
+    // Jump back to a loop header.
+    Back,
+};
+
+struct Stmt {
+    StmtKind kind;
+    const llvm::BasicBlock *block = nullptr;
+    // For edges, the block the edge comes from.
+    const llvm::BasicBlock *from = nullptr;
+    EdgeKind edge = EdgeKind::Inline;
+
+    std::vector<std::unique_ptr<Stmt>> children;
+    // For switches, the case values leading to each arm.
+    std::vector<std::vector<uint64_t>> cases;
+
+    Stmt(StmtKind kind, const llvm::BasicBlock *block) : kind(kind), block(block) {}
+};
+
+// Recovers structured control flow from a reducible CFG, following Ramsey's
+// "Beyond Relooper" translation based on the dominator tree.
+class Structurizer {
+    const llvm::Function& func;
+
+    std::vector<const llvm::BasicBlock *> rpo;
+    std::map<const llvm::BasicBlock *, uint32_t> order;
+    std::map<const llvm::BasicBlock *, const llvm::BasicBlock *> idom;
+    std::map<const llvm::BasicBlock *, std::vector<const llvm::BasicBlock *>> mergeChildren;
+    std::map<const llvm::BasicBlock *, uint32_t> forwardPreds;
+    std::map<const llvm::BasicBlock *, bool> loopHeaders;
+
+    void computeOrder();
+    void computeDominators();
+    bool dominates(const llvm::BasicBlock *a, const llvm::BasicBlock *b) const;
+    bool isBackEdge(const llvm::BasicBlock *from, const llvm::BasicBlock *to) const;
+
+    std::unique_ptr<Stmt> doTree(const llvm::BasicBlock *block);
+    std::unique_ptr<Stmt> nodeWithin(const llvm::BasicBlock *block, size_t merges);
+    std::unique_ptr<Stmt> doBranch(const llvm::BasicBlock *from, const llvm::BasicBlock *to);
+    std::unique_ptr<Stmt> terminator(const llvm::BasicBlock *block);
+
+public:
+    Structurizer(const llvm::Function& func);
+
+    // Returns whether every loop in the function has a single entry.
+    bool isReducible() const;
+
+    // Build the statement tree for the function. Must only be called on
+    // reducible functions.
+    std::unique_ptr<Stmt> structure();
+};
+
+#endif
@@ -0,0 +1,215 @@
+#include <algorithm>
+
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/GetElementPtrTypeIterator.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Operator.h>
+
+#include "memory.hpp"
+#include "targets.hpp"
+
+// Longer chains of comparisons cost more than the dispatcher saves.
+static constexpr size_t MAX_CALL_TARGETS = 4;
+
+CallTargets::CallTargets(const llvm::DataLayout& layout) : layout(layout) {}
+
+std::vector<CallTargets::Location> CallTargets::locations(const llvm::Value *ptr) const {
+    if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(ptr)) {
+        return { { global, 0 } };
+    }
+
+    auto gep = llvm::dyn_cast<llvm::GEPOperator>(ptr);
+    if (gep == nullptr)
+        return {};
+
+    // Every struct passed through is a location, with the offset from its start.
+    std::vector<Location> result;
+    bool isConstant = true;
+    uint64_t offset = 0;
+    for (auto it = llvm::gep_type_begin(gep); it != llvm::gep_type_end(gep); ++it) {
+        auto index = llvm::dyn_cast<llvm::ConstantInt>(it.getOperand());
+        uint64_t delta;
+        if (auto s = it.getStructTypeOrNull()) {
+            auto field = index->getZExtValue();
+            delta = layout.getStructLayout(s)->getElementOffset(field).getFixedValue();
+            result.emplace_back(s, 0);
+        } else if (index) {
+            delta = index->getSExtValue() * layout.getTypeAllocSize(it.getIndexedType()).getFixedValue();
+        } else {
+            // The offset into anything enclosing this is not known.
+            result.clear();
+            isConstant = false;
+            continue;
+        }
+
+        for (auto& location : result) {
+            location.second += delta;
+        }
+        offset += delta;
+    }
+
+    if (isConstant) {
+        if (auto global = llvm::dyn_cast<llvm::GlobalVariable>(gep->getPointerOperand())) {
+            result.insert(result.begin(), { global, offset });
+        }
+    }
+
+    return result;
+}
+
+void CallTargets::addInitializer(const llvm::Constant *c, std::vector<Location> where) {
+    if (auto f = llvm::dyn_cast<llvm::Function>(c)) {
+        for (const auto& location : where) {
+            stored[location].insert(f);
+        }
+    } else if (auto s = llvm::dyn_cast<llvm::ConstantStruct>(c)) {
+        auto structLayout = layout.getStructLayout(s->getType());
+        for (auto i = 0U; i < s->getNumOperands(); i++) {
+            auto inner = where;
+            auto delta = structLayout->getElementOffset(i).getFixedValue();
+            inner.emplace_back(s->getType(), 0);
+            for (auto& location : inner) {
+                location.second += delta;
+            }
+            addInitializer(s->getOperand(i), inner);
+        }
+    } else if (auto a = llvm::dyn_cast<llvm::ConstantArray>(c)) {
+        auto size = layout.getTypeAllocSize(a->getType()->getElementType()).getFixedValue();
+        for (auto i = 0U; i < a->getNumOperands(); i++) {
+            auto inner = where;
+            for (auto& location : inner) {
+                location.second += i * size;
+            }
+            addInitializer(a->getOperand(i), inner);
+        }
+    }
+}
+
+void CallTargets::addStore(const llvm::Value *value, const std::vector<Location>& where, std::set<const llvm::Value *>& visited) {
+    if (!visited.insert(value).second)
+        return;
+
+    if (auto f = llvm::dyn_cast<llvm::Function>(value)) {
+        for (const auto& location : where) {
+            stored[location].insert(f);
+        }
+    } else if (auto load = llvm::dyn_cast<llvm::LoadInst>(value)) {
+        // Copy from the global, or else the outermost struct, that the value
+        // was loaded from.
+        auto from = locations(load->getPointerOperand());
+        if (from.empty())
+            return;
+        for (const auto& location : where) {
+            copies[from.front()].insert(location);
+        }
+    } else if (auto phi = llvm::dyn_cast<llvm::PHINode>(value)) {
+        for (const auto& incoming : phi->incoming_values()) {
+            addStore(incoming, where, visited);
+        }
+    } else if (auto select = llvm::dyn_cast<llvm::SelectInst>(value)) {
+        addStore(select->getTrueValue(), where, visited);
+        addStore(select->getFalseValue(), where, visited);
+    }
+}
+
+void CallTargets::propagate() {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (const auto& [from, to] : copies) {
+            auto it = stored.find(from);
+            if (it == stored.end())
+                continue;
+            for (const auto& location : to) {
+                auto& functions = stored[location];
+                auto size = functions.size();
+                functions.insert(it->second.begin(), it->second.end());
+                changed |= functions.size() != size;
+            }
+        }
+    }
+}
+
+void CallTargets::analyze(const llvm::Module& m) {
+    for (const auto& global : m.globals()) {
+        if (global.hasInitializer()) {
+            addInitializer(global.getInitializer(), { { &global, 0 } });
+        }
+    }
+
+    for (const auto& func : m) {
+        for (const auto& block : func) {
+            for (const auto& ins : block) {
+                if (auto store = llvm::dyn_cast<llvm::StoreInst>(&ins)) {
+                    if (!store->getValueOperand()->getType()->isPointerTy())
+                        continue;
+                    std::set<const llvm::Value *> visited;
+                    addStore(store->getValueOperand(), locations(store->getPointerOperand()), visited);
+                }
+            }
+        }
+    }
+
+    propagate();
+
+    for (const auto& func : m) {
+        for (const auto& block : func) {
+            for (const auto& ins : block) {
+                auto call = llvm::dyn_cast<llvm::CallInst>(&ins);
+                if (call == nullptr || call->getCalledFunction() != nullptr || call->isInlineAsm())
+                    continue;
+
+                auto load = llvm::dyn_cast<llvm::LoadInst>(call->getCalledOperand());
+                if (load == nullptr)
+                    continue;
+
+                // The smallest set is the most precise one.
+                const std::set<const llvm::Function *> *best = nullptr;
+                for (const auto& location : locations(load->getPointerOperand())) {
+                    auto it = stored.find(location);
+                    if (it == stored.end())
+                        continue;
+                    if (best == nullptr || it->second.size() < best->size()) {
+                        best = &it->second;
+                    }
+                }
+                if (best == nullptr)
+                    continue;
+
+                FuncPtrType type(call->getFunctionType());
+                std::vector<const llvm::Function *> targets;
+                for (const auto f : *best) {
+                    if (f->hasAddressTaken() && FuncPtrType(f->getFunctionType()) == type) {
+                        targets.push_back(f);
+                    }
+                }
+                if (targets.empty())
+                    continue;
+
+                // Functions referenced from more places are guessed to be
+                // called more often.
+                std::sort(targets.begin(), targets.end(), [](const llvm::Function *a, const llvm::Function *b) {
+                    if (a->getNumUses() != b->getNumUses())
+                        return a->getNumUses() > b->getNumUses();
+                    return a->getName() < b->getName();
+                });
+                if (targets.size() > MAX_CALL_TARGETS) {
+                    targets.resize(MAX_CALL_TARGETS);
+                }
+
+                calls[call] = std::move(targets);
+            }
+        }
+    }
+}
+
+const std::vector<const llvm::Function *> *CallTargets::get(const llvm::CallInst *call) const {
+    auto it = calls.find(call);
+    if (it == calls.end())
+        return nullptr;
+    return &it->second;
+}
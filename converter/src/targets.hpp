@@ -0,0 +1,49 @@
+#ifndef CONVERTER_TARGETS_H
+#define CONVERTER_TARGETS_H
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <vector>
+
+namespace llvm {
+    class CallInst;
+    class Constant;
+    class DataLayout;
+    class Function;
+    class Module;
+    class Value;
+}
+
+// Finds the functions each indirect call is likely to reach. Function
+// addresses are tracked through the globals and struct fields they are stored
+// in, so the result is only a guess and calls still need a fallback.
+class CallTargets {
+    // Either a global with an offset into it, or a struct type with the offset
+    // of a field.
+    using Location = std::pair<const void *, uint64_t>;
+
+    const llvm::DataLayout& layout;
+
+    std::map<Location, std::set<const llvm::Function *>> stored;
+    // Locations whose functions are copied into another location.
+    std::map<Location, std::set<Location>> copies;
+
+    std::map<const llvm::CallInst *, std::vector<const llvm::Function *>> calls;
+
+    std::vector<Location> locations(const llvm::Value *ptr) const;
+    void addInitializer(const llvm::Constant *c, std::vector<Location> where);
+    void addStore(const llvm::Value *value, const std::vector<Location>& where, std::set<const llvm::Value *>& visited);
+    void propagate();
+
+public:
+    CallTargets(const llvm::DataLayout& layout);
+
+    void analyze(const llvm::Module& m);
+
+    // Get the likely targets of an indirect call, most likely first, or
+    // nullptr if nothing is known.
+    const std::vector<const llvm::Function *> *get(const llvm::CallInst *call) const;
+};
+
+#endif
@@ -130,6 +130,8 @@
 //	G_game.C
 //
 #define GGSAVED	"game saved."
+#define GGSAVETOOBIG	"savegame too large to keep."
+#define GGLOADBAD	"savegame is damaged."
 
 //
 //	HU_stuff.C
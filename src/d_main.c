@@ -1078,12 +1078,14 @@ static void G_CheckDemoStatusAtExit (void)
 }
 
 //
-// D_DoomMain
+// D_DoomInit
+// Everything up to the point where the game starts. This only depends on
+// the WAD files, so the converter can run it ahead of time and save the
+// result as a snapshot.
 //
-void D_DoomMain (void)
+void D_DoomInit (void)
 {
     int p;
-    char demolumpname[9];
 
     // print banner
 
@@ -1457,6 +1459,16 @@ void D_DoomMain (void)
 
     if (gamemode == commercial && W_CheckNumForName("map01") < 0)
         storedemo = true;
+}
+
+//
+// D_DoomStart
+// Start the game after D_DoomInit, or after resuming from a snapshot of it.
+//
+void D_DoomStart (void)
+{
+    int p;
+    char demolumpname[9];
 
     //!
     // @arg <x>
@@ -1502,3 +1514,12 @@ void D_DoomMain (void)
     D_DoomLoop ();
 }
 
+//
+// D_DoomMain
+//
+void D_DoomMain (void)
+{
+    D_DoomInit ();
+    D_DoomStart ();
+}
+
@@ -1373,11 +1373,17 @@ void G_DoLoadGame (void)
     gameaction = ga_nothing; 
 
     G_SaveLoad(saveslot);
-
     savegame_error = false;
 
+    if (!P_StartLoadGame())
+    {
+        players[consoleplayer].message = DEH_String(GGLOADBAD);
+        return;
+    }
+
     if (!P_ReadSaveGameHeader())
     {
+        P_FinishLoadGame();
         return;
     }
 
@@ -1396,6 +1402,8 @@ void G_DoLoadGame (void)
  
     if (!P_ReadSaveGameEOF())
 	I_Error ("Bad savegame");
+
+    P_FinishLoadGame();
     
     if (setsizeneeded)
 	R_ExecuteSetViewSize ();
@@ -1422,7 +1430,10 @@ G_SaveGame
 
 void G_DoSaveGame (void) 
 { 
+    boolean saved;
+
     G_SaveStart(savegameslot);
+    P_StartSaveGame();
 
     savegame_error = false;
 
@@ -1437,12 +1448,12 @@ void G_DoSaveGame (void)
 
     // Finish up, close the savegame file.
 
-    G_SaveCommit();
+    saved = P_FinishSaveGame();
 
     gameaction = ga_nothing;
     M_StringCopy(savedescription, "", sizeof(savedescription));
 
-    players[consoleplayer].message = DEH_String(GGSAVED);
+    players[consoleplayer].message = DEH_String(saved ? GGSAVED : GGSAVETOOBIG);
 
     // draw the pattern into the back screen
     R_FillBackScreen ();
@@ -85,13 +85,12 @@ extern boolean sendpause;
 
 void G_SaveLoad(int slot);
 void G_SaveStart(int slot);
-void G_SaveCommit(void);
 
 boolean G_SaveRead(void *out, int length);
 
-void G_WriteSaveByte(byte b);
-unsigned int G_LoadSize(void);
-unsigned int G_SaveSize(void);
+int G_SaveLength(void);
+boolean G_SaveReadBlock(void *out, int length);
+boolean G_SaveWriteBlock(const void *in, int length);
 
 
 #endif
@@ -67,14 +67,6 @@ void I_Tactile(int on, int off, int total)
 {
 }
 
-byte *I_ZoneBase (int *size)
-{
-    // int32 for alignment reasons
-    static uint32_t zonemem[3 * 1024 * 1024];
-    *size = sizeof(zonemem);
-    return (byte *) zonemem;
-}
-
 void I_PrintBanner(const char *msg)
 {
     int i;
@@ -32,6 +32,8 @@ void I_Init (void);
 // Called by startup code
 // to get the ammount of memory to malloc
 // for the zone management.
+// Provided by the runtime, which sizes it
+// from the converter's --zone-size.
 byte*	I_ZoneBase (int *size);
 
 
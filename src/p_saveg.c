@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "dstrings.h"
 #include "deh_main.h"
@@ -36,13 +37,22 @@
 int savegamelength;
 boolean savegame_error;
 
+// Initial size of the buffer a savegame is written to, which is vanilla's
+// limit on savegames. It grows if that is not enough.
+#define SAVEGAME_BUFFER_SIZE 0x2c000
+
+// The savegame being written or read. It is built up here and handed to the
+// runtime in one go, rather than a byte at a time.
+static byte *save_buffer;
+static int save_length;
+static int save_capacity;
+static int save_pos;
+
 // Endian-safe integer read/write functions
 
 static byte saveg_read8(void)
 {
-    byte result = -1;
-
-    if (!G_SaveRead(&result, 1))
+    if (save_pos >= save_length)
     {
         if (!savegame_error)
         {
@@ -51,14 +61,118 @@ static byte saveg_read8(void)
 
             savegame_error = true;
         }
+
+        return -1;
     }
 
-    return result;
+    return save_buffer[save_pos++];
 }
 
 static void saveg_write8(byte value)
 {
-    G_WriteSaveByte(value);
+    if (save_length == SAVEGAME_MAX_SIZE)
+    {
+        if (!savegame_error)
+        {
+            printf("saveg_write8: Save game is larger than %d bytes\n",
+                   SAVEGAME_MAX_SIZE);
+
+            savegame_error = true;
+        }
+
+        return;
+    }
+
+    if (save_length == save_capacity)
+    {
+        byte *grown;
+
+        save_capacity = save_capacity ? save_capacity * 2 : SAVEGAME_BUFFER_SIZE;
+        if (save_capacity > SAVEGAME_MAX_SIZE)
+        {
+            save_capacity = SAVEGAME_MAX_SIZE;
+        }
+        grown = Z_Malloc(save_capacity, PU_STATIC, NULL);
+        if (save_buffer != NULL)
+        {
+            memcpy(grown, save_buffer, save_length);
+            Z_Free(save_buffer);
+        }
+        save_buffer = grown;
+    }
+
+    save_buffer[save_length++] = value;
+}
+
+static void saveg_free_buffer(void)
+{
+    if (save_buffer != NULL)
+    {
+        Z_Free(save_buffer);
+    }
+
+    save_buffer = NULL;
+    save_length = 0;
+    save_capacity = 0;
+    save_pos = 0;
+}
+
+//
+// Start writing a savegame to the buffer.
+//
+
+void P_StartSaveGame(void)
+{
+    saveg_free_buffer();
+}
+
+//
+// Hand the savegame written to the runtime.
+//
+
+boolean P_FinishSaveGame(void)
+{
+    boolean result;
+
+    result = !savegame_error && G_SaveWriteBlock(save_buffer, save_length);
+    saveg_free_buffer();
+
+    return result;
+}
+
+//
+// Read the savegame G_SaveLoad chose into the buffer.
+//
+
+boolean P_StartLoadGame(void)
+{
+    saveg_free_buffer();
+
+    save_length = G_SaveLength();
+    if (save_length <= 0 || save_length > SAVEGAME_MAX_SIZE)
+    {
+        save_length = 0;
+        return false;
+    }
+
+    save_capacity = save_length;
+    save_buffer = Z_Malloc(save_capacity, PU_STATIC, NULL);
+    if (!G_SaveReadBlock(save_buffer, save_length))
+    {
+        saveg_free_buffer();
+        return false;
+    }
+
+    return true;
+}
+
+//
+// Free the savegame read.
+//
+
+void P_FinishLoadGame(void)
+{
+    saveg_free_buffer();
 }
 
 static short saveg_read16(void)
@@ -105,7 +219,7 @@ static void saveg_read_pad(void)
     int padding;
     int i;
 
-    pos = G_LoadSize();
+    pos = save_pos;
 
     padding = (4 - (pos & 3)) & 3;
 
@@ -121,7 +235,7 @@ static void saveg_write_pad(void)
     int padding;
     int i;
 
-    pos = G_SaveSize();
+    pos = save_length;
 
     padding = (4 - (pos & 3)) & 3;
 
@@ -29,6 +29,19 @@
 
 #define SAVESTRINGSIZE 24
 
+// Savegames are written to and read from a buffer in memory, which is
+// moved to and from the runtime whole. P_FinishSaveGame returns false if
+// the savegame is too large or the runtime could not keep it, and
+// P_StartLoadGame returns false if there is no savegame or it is damaged.
+
+// Largest savegame written. This must match g_game.zs.
+#define SAVEGAME_MAX_SIZE 0x100000
+
+void P_StartSaveGame(void);
+boolean P_FinishSaveGame(void);
+boolean P_StartLoadGame(void);
+void P_FinishLoadGame(void);
+
 // Savegame file header read/write functions
 
 boolean P_ReadSaveGameHeader(void);
@@ -801,7 +801,7 @@ void R_PrecacheLevel (void)
 	if (flatpresent[i])
 	{
 	    lump = firstflat + i;
-	    flatmemory += lumpinfo[lump].size;
+	    flatmemory += W_LumpLength(lump);
 	    W_CacheLumpNum(lump, PU_CACHE);
 	}
     }
@@ -838,7 +838,7 @@ void R_PrecacheLevel (void)
 	for (j=0 ; j<texture->patchcount ; j++)
 	{
 	    lump = texture->patches[j].patch;
-	    texturememory += lumpinfo[lump].size;
+	    texturememory += W_LumpLength(lump);
 	    W_CacheLumpNum(lump , PU_CACHE);
 	}
     }
@@ -867,7 +867,7 @@ void R_PrecacheLevel (void)
 	    for (k=0 ; k<8 ; k++)
 	    {
 		lump = firstspritelump + sf->lump[k];
-		spritememory += lumpinfo[lump].size;
+		spritememory += W_LumpLength(lump);
 		W_CacheLumpNum(lump , PU_CACHE);
 	    }
 	}
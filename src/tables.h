@@ -49,7 +49,9 @@
 extern const fixed_t finesine[5*FINEANGLES/4];
 
 // Re-use data, is just PI/2 pahse shift.
-extern const fixed_t *finecosine;
+// A macro rather than a pointer variable, so that
+// lookups index finesine directly.
+#define finecosine (&finesine[FINEANGLES/4])
 
 
 // Effective size is 4096.
@@ -82,6 +82,10 @@ int W_Load(void);
 
 void W_ReadLumps(lumpinfo_t *);
 
+// The runtime has to read a lump to learn its size, so sizes are only
+// asked for when needed.
+int W_ReadLumpSize(lumpindex_t lump);
+
 //
 // LUMP BASED ROUTINES.
 //
@@ -185,6 +189,11 @@ int W_LumpLength(lumpindex_t lump)
 	I_Error ("W_LumpLength: %i >= numlumps", lump);
     }
 
+    if (lumpinfo[lump].size < 0)
+    {
+        lumpinfo[lump].size = W_ReadLumpSize(lump);
+    }
+
     return lumpinfo[lump].size;
 }
 
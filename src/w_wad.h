@@ -39,6 +39,7 @@ typedef int lumpindex_t;
 struct lumpinfo_s
 {
     char	name[8];
+    // -1 until W_LumpLength asks the runtime for it.
     int		size;
     void       *cache;
 